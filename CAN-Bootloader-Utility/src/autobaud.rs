@@ -0,0 +1,65 @@
+// Bit timing negotiation with the loader (-autobaud)
+use bus::Bus;
+use loader::*;
+use protocol::*;
+
+const PROBE_PINGS: u32 = 64;
+const SWITCH_TIMEOUT: u32 = 2000;
+// The loader reverts a profile switch after a few silent heartbeats
+const REVERT_TIMEOUT: u32 = 5000;
+
+// Ping the loader and check the bus stayed free of errors
+fn probe(bus: &mut dyn Bus) -> bool {
+	let mut errors = 0;
+	let before = bus.error_counters();
+	for _ in 0..PROBE_PINGS {
+		match command(bus, CMD_PING, 0, &mut errors) {
+			Some(ref reply) if reply.status == STATUS_ACK => {}
+			_ => return false,
+		}
+	}
+	let after = bus.error_counters();
+	errors == 0 && after.0 <= before.0 && after.1 <= before.1 && after.2 == before.2
+}
+
+// Switch the loader and the bus to each candidate in turn and keep the first
+// one that passes the probe. The loader must have just sent a heartbeat in
+// the start profile. Returns the profile both ends are left in.
+pub fn negotiate(bus: &mut dyn Bus, start: u8, candidates: &[u8]) -> u8 {
+	let mut errors = 0;
+	for &profile in candidates {
+		if profile == start {
+			if probe(bus) {
+				note!("Trying {} ... ok", profile_name(profile));
+				return start;
+			}
+			note!("Trying {} ... errors", profile_name(profile));
+			continue;
+		}
+
+		match command(bus, CMD_SET_PROFILE, profile, &mut errors) {
+			Some(ref reply) if reply.status == STATUS_ACK && reply.data == profile as u32 => {}
+			_ => {
+				note!("Trying {} ... not supported by the loader", profile_name(profile));
+				return start;
+			}
+		}
+		set_profile(bus, profile);
+		if wait_heartbeat(bus, SWITCH_TIMEOUT) && probe(bus) {
+			note!("Trying {} ... ok", profile_name(profile));
+			return profile;
+		}
+		note!("Trying {} ... errors", profile_name(profile));
+
+		// Ask the loader back if it can still hear us, else wait for it to
+		// revert on its own
+		command(bus, CMD_SET_PROFILE, start, &mut errors);
+		set_profile(bus, start);
+		bus.flush();
+		if !wait_heartbeat(bus, REVERT_TIMEOUT) {
+			note!("Loader did not return to {}", profile_name(start));
+			return start;
+		}
+	}
+	start
+}
@@ -0,0 +1,293 @@
+// Throughput benchmark (-bench file.csv): bootloads synthetic images into
+// the simulated loader over a matrix of image sizes, frame formats, bit
+// rates, flash timings and bus error rates. Times are simulated, so the CSV
+// only changes when the protocol, the utility or the model does and can be
+// diffed between commits.
+//
+// The recovery table (-recovery file.csv) bootloads one image with faults
+// injected at set frames and reports what each costs over a clean run.
+//
+// Both run every case with and without a send window.
+use std::fs::File;
+use std::io::Write;
+use bus::Bus;
+use image;
+use image::Image;
+use protocol::*;
+use session;
+use session::{Options, Stats};
+use sim::*;
+use events;
+
+const SIM_DEVICE: u32 = 0x100;
+const RING_FRAMES: usize = 63;		// CAN_RING_SIZE - 1
+const MAX_RETRIES: u32 = 2;
+const BLOCK_WORDS: usize = 1024;
+const ENTRY_OFFSET: u32 = 0x10;
+
+// Image sizes in words, up to a full slot behind its header
+const SIZES: [usize; 4] = [1024, 4096, 16384, 0x6000 - 16];
+const FORMATS: [(&'static str, u8); 2] = [
+	("single", MODE_COMMANDS | MODE_CRC | MODE_WINDOW | MODE_POSITION | MODE_KEEP | MODE_SLOT_CRC),
+	("multi", MODE_COMMANDS | MODE_MULTIWORD | MODE_CRC | MODE_WINDOW | MODE_POSITION | MODE_KEEP | MODE_SLOT_CRC),
+];
+const WINDOWS: [usize; 2] = [0, session::DEFAULT_WINDOW];
+const PROFILES: [u8; 2] = [0, 2];
+const FLASH: [&'static FlashTiming; 2] = [&FLASH_TYPICAL, &FLASH_SLOW];
+const LOSS: [f64; 3] = [0.0, 0.001, 0.01];
+
+// Recovery scenarios, see sim::parse_faults(). LAST stands for the final
+// frame of the stream.
+const RECOVERY_WORDS: usize = 16384;
+const LAST: &'static str = "last";
+const SCENARIOS: [(&'static str, &'static str); 8] = [
+	("clean", ""),
+	("drop", "drop@2000"),
+	("drop_last", "drop@last"),
+	("duplicate", "dup@2000"),
+	("reorder", "reorder@2000"),
+	("bit_errors", "biterr@1/50"),
+	("bus_off", "busoff@2000"),
+	("bus_off_repeated", "busoff@1/1000"),
+];
+
+// Boot stream for size words of filler linked at the start of slot
+fn synthetic(size: usize, slot: usize) -> Image {
+	let start = image::SLOT_RANGES[slot].0 + 16;
+	let entry = start + ENTRY_OFFSET;
+	let mut words = vec![image::KEY_VALUE, 0, 0, 0, 0, 0, 0, 0, 0, (entry >> 16) as u16, entry as u16];
+	let mut fill: u16 = 0xACE1;
+	let mut offset = 0;
+	while offset < size {
+		let block = ::std::cmp::min(BLOCK_WORDS, size - offset);
+		let addr = start + offset as u32;
+		words.push(block as u16);
+		words.push((addr >> 16) as u16);
+		words.push(addr as u16);
+		for _ in 0..block {
+			fill = (fill >> 1) ^ (0u16.wrapping_sub(fill & 1) & 0xB400);
+			words.push(fill);
+		}
+		offset += block;
+	}
+	words.push(0);
+	Image::from_words(words).unwrap()
+}
+
+fn seconds(ns: u64) -> f64 {
+	ns as f64 / 1e9
+}
+
+fn percent(part: u64, whole: u64) -> f64 {
+	if whole == 0 { 0.0 } else { part as f64 * 100.0 / whole as f64 }
+}
+
+fn save(path: &str, csv: &str) -> Result<(), String> {
+	let mut file = match File::create(path) {
+		Ok(file) => file,
+		Err(e) => return Err(format!("Unable to create {}. Error: {}", path, e)),
+	};
+	match file.write_all(csv.as_bytes()) {
+		Ok(()) => Ok(()),
+		Err(e) => Err(format!("Unable to write {}. Error: {}", path, e)),
+	}
+}
+
+// Bootload images into a fresh simulated loader at 1 Mbit/s
+fn simulate(images: &[Image], config: Config, window: usize) -> (SimBus, Stats, Result<(), String>) {
+	let profile = config.profile;
+	let mut sim = SimBus::new(config);
+	let options = Options {
+		bitrate: -1,
+		bypass: false,
+		boot_profile: profile,
+		autobaud: false,
+		max_retries: MAX_RETRIES,
+		window: window,
+		ram: false,
+		base: Vec::new(),
+		inventory: None,
+		dump: None,
+		budget: None,
+		ids: None,
+		selftest: false,
+	};
+	sim.set_params(options.bitrate, 0, 0, 0);
+	let mut stats = Stats::default();
+	let outcome = session::bootload(&mut sim, 0, SIM_DEVICE, images, &options, &mut stats);
+	(sim, stats, outcome)
+}
+
+pub fn run(path: &str) -> Result<(), String> {
+	let mut csv = String::from("words,format,window,kbps,flash,loss_pct,result,attempts,total_s,send_s,frames,bus_errors,overruns,bus_util_pct,cpu_headroom_pct\n");
+
+	// The session's own progress text would drown the table
+	events::silence();
+	let cases = SIZES.len() * FORMATS.len() * WINDOWS.len() * PROFILES.len() * FLASH.len() * LOSS.len();
+	let mut case = 0;
+	let mut failed = 0;
+	for &size in &SIZES {
+		let images = vec![synthetic(size, 0), synthetic(size, 1)];
+		for &(format, modes) in &FORMATS {
+			for &window in &WINDOWS {
+				for &profile in &PROFILES {
+					for &flash in &FLASH {
+						for &loss in &LOSS {
+							case += 1;
+							let (mut sim, stats, outcome) = simulate(&images, Config {
+								device: SIM_DEVICE,
+								version: 11,
+								modes: modes,
+								ring_frames: RING_FRAMES,
+								profile: profile,
+								flash: flash,
+								loss: loss,
+								seed: case as u64,
+								faults: Vec::new(),
+							}, window);
+							let metrics = sim.metrics();
+							let (freq, _, _, _) = bus_params(profile);
+							if outcome.is_err() {
+								failed += 1;
+							}
+
+							let row = format!("{},{},{},{},{},{},{},{},{:.3},{:.3},{},{},{},{:.1},{:.1}\n",
+								size, format, window, freq / 1000, flash.name, loss * 100.0,
+								if outcome.is_ok() { "ok" } else { "fail" },
+								stats.retries + 1,
+								seconds(sim.now()), seconds(metrics.send_ns),
+								stats.frames, sim.error_counters().0, metrics.overruns,
+								percent(metrics.bus_ns, metrics.send_ns),
+								100.0 - percent(metrics.cpu_ns, metrics.send_ns));
+							println!("{}/{} {}", case, cases, row.trim());
+							csv.push_str(&row);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	save(path, &csv)?;
+	if failed != 0 {
+		return Err(format!("{} of {} cases failed, see {}", failed, cases, path));
+	}
+	Ok(())
+}
+
+// Loader for the recovery table: typical flash at the default profile,
+// faults where given and no random loss
+fn recovery_config(modes: u8, faults: Vec<Injection>) -> Config {
+	Config {
+		device: SIM_DEVICE,
+		version: 11,
+		modes: modes,
+		ring_frames: RING_FRAMES,
+		profile: PROFILE_DEFAULT,
+		flash: &FLASH_TYPICAL,
+		loss: 0.0,
+		seed: 1,
+		faults: faults,
+	}
+}
+
+// Time to recover is the total time over the clean run's, re-sent bytes the
+// data frame payload over one stream's. spec replaces the built in
+// scenarios when given.
+pub fn recovery(path: &str, spec: Option<&str>) -> Result<(), String> {
+	let mut csv = String::from("scenario,format,window,result,attempts,total_s,recover_s,resent_bytes,bus_errors,overruns\n");
+	let scenarios: Vec<(&str, &str)> = match spec {
+		Some(spec) => vec![("clean", ""), ("custom", spec)],
+		None => SCENARIOS.to_vec(),
+	};
+
+	events::silence();
+	let images = vec![synthetic(RECOVERY_WORDS, 0), synthetic(RECOVERY_WORDS, 1)];
+	let mut failed = 0;
+	for &(format, modes) in &FORMATS {
+		for &window in &WINDOWS {
+			let caps = Caps { version: 11, modes: modes, ring_frames: RING_FRAMES as u8 };
+			let ring = images[1].frames(session::words_per_frame(&caps, window));
+			let mut clean_ns = 0;
+			for &(scenario, faults) in &scenarios {
+				let faults = parse_faults(&faults.replace(LAST, &ring.len().to_string()))?;
+				let (mut sim, stats, outcome) = simulate(&images, recovery_config(modes, faults), window);
+				if scenario == "clean" {
+					clean_ns = sim.now();
+				}
+				if outcome.is_err() {
+					failed += 1;
+				}
+
+				let row = format!("{},{},{},{},{},{:.3},{:.3},{},{},{}\n",
+					scenario, format, window,
+					if outcome.is_ok() { "ok" } else { "fail" },
+					stats.retries + 1,
+					seconds(sim.now()), seconds(sim.now().saturating_sub(clean_ns)),
+					stats.bytes.saturating_sub(ring.bytes()),
+					sim.error_counters().0, sim.metrics().overruns);
+				println!("{}", row.trim());
+				csv.push_str(&row);
+			}
+		}
+	}
+
+	save(path, &csv)?;
+	if failed != 0 {
+		return Err(format!("{} scenarios failed, see {}", failed, path));
+	}
+	Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+	use super::*;
+
+	// With the window a fault costs the frames it hit, not the attempt
+	const WINDOW_RECOVER_NS: u64 = 500000000;
+	const WINDOW_RESENT_FRAMES: u64 = 2;
+	// Without it the attempt is lost, but one retry gets the image through
+	// within the reply timeout of a clean run
+	const RETRY_RECOVER_NS: u64 = 10000000000;
+
+	// Every built in scenario for one format and window: the run must
+	// succeed, and its cost over the clean run stay within recover_ns and
+	// resent bytes of re-sent payload
+	fn scenarios(modes: u8, window: usize, recover_ns: u64, resent: u64, attempts: u32) {
+		let images = vec![synthetic(RECOVERY_WORDS, 0), synthetic(RECOVERY_WORDS, 1)];
+		let caps = Caps { version: 11, modes: modes, ring_frames: RING_FRAMES as u8 };
+		let ring = images[1].frames(session::words_per_frame(&caps, window));
+		let mut clean_ns = 0;
+		for &(scenario, faults) in &SCENARIOS {
+			let faults = parse_faults(&faults.replace(LAST, &ring.len().to_string())).unwrap();
+			let (sim, stats, outcome) = simulate(&images, recovery_config(modes, faults), window);
+			assert!(outcome.is_ok(), "{} failed: {:?}", scenario, outcome);
+			if scenario == "clean" {
+				clean_ns = sim.now();
+			}
+			let recover = sim.now().saturating_sub(clean_ns);
+			let bytes = stats.bytes.saturating_sub(ring.bytes());
+			assert!(stats.retries + 1 <= attempts, "{} took {} attempts", scenario, stats.retries + 1);
+			assert!(recover <= recover_ns, "{} took {:.3} s to recover", scenario, seconds(recover));
+			assert!(bytes <= resent, "{} sent {} bytes again", scenario, bytes);
+		}
+	}
+
+	#[test]
+	fn window_recovers_single_word_frames() {
+		scenarios(FORMATS[0].1, session::DEFAULT_WINDOW, WINDOW_RECOVER_NS, WINDOW_RESENT_FRAMES * 4, 1);
+	}
+
+	#[test]
+	fn window_recovers_multi_word_frames() {
+		scenarios(FORMATS[1].1, session::DEFAULT_WINDOW, WINDOW_RECOVER_NS, WINDOW_RESENT_FRAMES * 8, 1);
+	}
+
+	#[test]
+	fn retry_recovers_without_window() {
+		let stream = synthetic(RECOVERY_WORDS, 1).frames(1).bytes();
+		for &(_, modes) in &FORMATS {
+			scenarios(modes, 0, RETRY_RECOVER_NS, stream, 2);
+		}
+	}
+}
@@ -0,0 +1,241 @@
+// Bootloading on a live vehicle bus. Scheduler stands between the session
+// and the channel:
+//
+// - After the loader took SET_IDS (-ids), data frames go out on the data ID
+//   given and replies on the reply ID are handed on as REPLY_ID, so the
+//   rest of the utility keeps to the IDs of the protocol.
+// - With a bus load budget (-budget) a token bucket holds writes back so
+//   the bus stays under it. The bucket fills at the budget less what other
+//   nodes use, as measured by the interface, but never slower than
+//   MIN_SHARE of the budget so the update still gets through. Replies from
+//   the loader count as other traffic, so they come out of the budget too.
+use std::cmp::min;
+use bus;
+use bus::Bus;
+use canlib::Frame;
+use protocol;
+
+// Bus load measured over this much time
+const LOAD_INTERVAL_US: u64 = 100000;
+const MIN_SHARE: f64 = 0.1;
+// Frames the bucket holds, sent back to back after the stream idled
+const BURST_FRAMES: u64 = 4;
+
+pub struct Scheduler<'a> {
+	channel: &'a mut dyn Bus,
+	pub ids: Option<(u32, u16)>,	// Data and reply IDs the loader moved to
+	budget: Option<f64>,
+	bitrate: u32,
+	share: f64,			// Of the bus, ours to use
+	tokens: u64,		// Bits we may send right away
+	filled: u64,		// clock() when tokens were last added
+	measured: u64,		// clock() at the last bus load reading
+	sent: u64,			// Bits sent since then
+}
+
+impl<'a> Scheduler<'a> {
+	pub fn new(channel: &'a mut dyn Bus, budget: Option<f64>, freq: i32) -> Scheduler<'a> {
+		let now = channel.clock();
+		Scheduler {
+			channel: channel,
+			ids: None,
+			budget: budget,
+			bitrate: bus::bitrate(freq).unwrap_or(1000000),
+			share: budget.unwrap_or(1.0),
+			tokens: BURST_FRAMES * bus::frame_bits(8),
+			filled: now,
+			measured: now,
+			sent: 0,
+		}
+	}
+
+	// Wait until bits may go out under the budget
+	fn take(&mut self, bits: u64) {
+		let budget = match self.budget {
+			Some(budget) => budget,
+			None => return,
+		};
+		let now = self.channel.clock();
+		if now - self.measured >= LOAD_INTERVAL_US {
+			if let Some(load) = self.channel.bus_load() {
+				let ours = self.sent as f64 * 1e6 / (self.bitrate as f64 * (now - self.measured) as f64);
+				let others = (load - ours).max(0.0);
+				self.share = (budget - others).max(budget * MIN_SHARE);
+			}
+			self.measured = now;
+			self.sent = 0;
+		}
+
+		// Bits per microsecond is share * bitrate / 1e6
+		let rate = self.share * self.bitrate as f64 / 1e6;
+		self.tokens = min(self.tokens + ((now - self.filled) as f64 * rate) as u64, BURST_FRAMES * bus::frame_bits(8));
+		self.filled = now;
+		if self.tokens < bits {
+			let wait = ((bits - self.tokens) as f64 / rate).ceil() as u32;
+			self.channel.pause(wait);
+			self.tokens = bits;
+			self.filled = self.channel.clock();
+		}
+		self.tokens -= bits;
+		self.sent += bits;
+	}
+}
+
+impl<'a> Bus for Scheduler<'a> {
+	fn write(&mut self, id: u32, data: &[u8]) -> i16 {
+		let id = match self.ids {
+			Some((data_id, _)) if id == protocol::DATA_ID => data_id,
+			_ => id,
+		};
+		self.take(bus::frame_bits(data.len()));
+		self.channel.write(id, data)
+	}
+
+	fn pause(&mut self, us: u32) {
+		self.channel.pause(us)
+	}
+
+	fn read(&mut self, timeout: u32) -> Result<Frame, i16> {
+		let mut frame = self.channel.read(timeout)?;
+		match self.ids {
+			Some((_, reply_id)) if frame.id == reply_id as i32 => frame.id = protocol::REPLY_ID as i32,
+			// Stale replies on the old ID are not the loader's any more
+			Some(_) if frame.id == protocol::REPLY_ID as i32 => frame.id = -1,
+			_ => {}
+		}
+		Ok(frame)
+	}
+
+	fn flush(&mut self) {
+		self.channel.flush()
+	}
+
+	fn set_params(&mut self, freq: i32, tseg1: u32, tseg2: u32, sjw: u32) -> i16 {
+		if let Some(rate) = bus::bitrate(freq) {
+			self.bitrate = rate;
+		}
+		self.channel.set_params(freq, tseg1, tseg2, sjw)
+	}
+
+	fn error_counters(&mut self) -> (u32, u32, u32) {
+		self.channel.error_counters()
+	}
+
+	fn clock(&mut self) -> u64 {
+		self.channel.clock()
+	}
+
+	fn bus_load(&mut self) -> Option<f64> {
+		self.channel.bus_load()
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use super::*;
+
+	// 1 Mbit/s bus where other nodes take others of the bus time
+	struct Line {
+		now: u64,			// Microseconds, one per bit
+		others: f64,
+		sent: u64,			// Our bits since the last bus_load()
+		since: u64,
+		ids: Vec<u32>,
+	}
+
+	impl Line {
+		fn new(others: f64) -> Line {
+			Line { now: 0, others: others, sent: 0, since: 0, ids: Vec::new() }
+		}
+	}
+
+	impl Bus for Line {
+		fn write(&mut self, id: u32, data: &[u8]) -> i16 {
+			let bits = bus::frame_bits(data.len());
+			self.now += bits;
+			self.sent += bits;
+			self.ids.push(id);
+			0
+		}
+
+		fn pause(&mut self, us: u32) {
+			self.now += us as u64;
+		}
+
+		fn read(&mut self, _: u32) -> Result<Frame, i16> {
+			Err(-2)
+		}
+
+		fn flush(&mut self) {}
+
+		fn set_params(&mut self, _: i32, _: u32, _: u32, _: u32) -> i16 {
+			0
+		}
+
+		fn error_counters(&mut self) -> (u32, u32, u32) {
+			(0, 0, 0)
+		}
+
+		fn clock(&mut self) -> u64 {
+			self.now
+		}
+
+		fn bus_load(&mut self) -> Option<f64> {
+			let ours = self.sent as f64 / (self.now - self.since) as f64;
+			self.sent = 0;
+			self.since = self.now;
+			Some(ours + self.others)
+		}
+	}
+
+	// Share of the bus we used sending frames back to back, over the second
+	// after the first load reading
+	fn used(budget: Option<f64>, others: f64) -> f64 {
+		let mut line = Line::new(others);
+		let mut bits = 0;
+		let start = LOAD_INTERVAL_US;
+		let mut scheduler = Scheduler::new(&mut line, budget, -1);
+		while scheduler.clock() < start {
+			scheduler.write(protocol::DATA_ID, &[0; 8]);
+		}
+		let from = scheduler.clock();
+		while scheduler.clock() < start + 1000000 {
+			scheduler.write(protocol::DATA_ID, &[0; 8]);
+			bits += bus::frame_bits(8);
+		}
+		bits as f64 / (scheduler.clock() - from) as f64
+	}
+
+	#[test]
+	fn no_budget_sends_back_to_back() {
+		assert!(used(None, 0.0) > 0.99);
+	}
+
+	#[test]
+	fn bucket_keeps_to_the_budget() {
+		let share = used(Some(0.3), 0.0);
+		assert!(share > 0.28 && share < 0.31, "used {}", share);
+	}
+
+	#[test]
+	fn other_traffic_comes_out_of_the_budget() {
+		let share = used(Some(0.5), 0.2);
+		assert!(share > 0.28 && share < 0.31, "used {}", share);
+		// Never below MIN_SHARE of the budget
+		let share = used(Some(0.5), 0.8);
+		assert!(share > 0.045 && share < 0.06, "used {}", share);
+	}
+
+	#[test]
+	fn data_frames_move_to_the_new_id() {
+		let mut line = Line::new(0.0);
+		{
+			let mut scheduler = Scheduler::new(&mut line, None, -1);
+			scheduler.write(0x7E0, &[0; 4]);
+			scheduler.ids = Some((0x600, 0x601));
+			scheduler.write(protocol::DATA_ID, &[0; 8]);
+			scheduler.write(0x7E0, &[0; 4]);
+		}
+		assert_eq!(line.ids, vec![0x7E0, 0x600, 0x7E0]);
+	}
+}
@@ -0,0 +1,112 @@
+// CAN channel the bootload runs over: a Kvaser channel, or the simulated
+// loader in sim.rs
+use libc::c_long;
+use std::time::{Duration, Instant};
+use canlib;
+use canlib::Frame;
+
+pub trait Bus {
+	// Send one frame, waiting until it is on the bus
+	fn write(&mut self, id: u32, data: &[u8]) -> i16;
+	// Hold off the next write for us microseconds
+	fn pause(&mut self, us: u32);
+	// Next frame in the receive queue, waiting up to timeout ms
+	fn read(&mut self, timeout: u32) -> Result<Frame, i16>;
+	fn flush(&mut self);
+	// canSetBusParams(): a canBITRATE_x constant with zero timing, or a
+	// frequency in Hz with tseg1, tseg2 and sjw in time quanta
+	fn set_params(&mut self, freq: i32, tseg1: u32, tseg2: u32, sjw: u32) -> i16;
+	// Transmit, receive and overrun error counters
+	fn error_counters(&mut self) -> (u32, u32, u32);
+	// Microseconds since the channel was opened
+	fn clock(&mut self) -> u64;
+	// Share of bus time in use since the last call, frames sent by anyone,
+	// if the channel can tell
+	fn bus_load(&mut self) -> Option<f64>;
+}
+
+// Bits per second for a canSetBusParams() frequency: canBITRATE_1M down to
+// canBITRATE_125K, or the frequency itself
+pub fn bitrate(freq: i32) -> Option<u32> {
+	match freq {
+		-1 => Some(1000000),
+		-2 => Some(500000),
+		-3 => Some(250000),
+		-4 => Some(125000),
+		f if f > 0 => Some(f as u32),
+		_ => None,
+	}
+}
+
+// Standard frame with dlc data bytes and worst case bit stuffing, in bits
+pub fn frame_bits(dlc: usize) -> u64 {
+	47 + 8 * dlc as u64 + (34 + 8 * dlc as u64 - 1) / 4
+}
+
+pub struct Channel {
+	handle: i16,
+	opened: Instant,
+}
+
+impl Channel {
+	pub fn open(bus: u16, bitrate: i32) -> Result<Channel, String> {
+		let handle = unsafe {canlib::canOpenChannel(bus, 0)};
+		if handle < canlib::ERROR_OK {
+			return Err(format!("Failed to open CAN channel!. Error: {}", handle));
+		}
+		let mut channel = Channel { handle: handle, opened: Instant::now() };
+
+		let mut result = channel.set_params(bitrate, 0, 0, 0);
+		if result != canlib::ERROR_OK {
+			return Err(format!("Failed to set CAN bus parameters. Error: {}", result));
+		}
+
+		result = unsafe {canlib::canBusOn(handle)};
+		if result != canlib::ERROR_OK {
+			return Err(format!("Failed to go bus on. Error: {}", result));
+		}
+		Ok(channel)
+	}
+
+	pub fn close(self) -> i16 {
+		unsafe {canlib::canClose(self.handle)}
+	}
+}
+
+impl Bus for Channel {
+	fn write(&mut self, id: u32, data: &[u8]) -> i16 {
+		canlib::write(self.handle, id, data)
+	}
+
+	fn pause(&mut self, us: u32) {
+		// Far shorter than thread::sleep() can wait
+		let start = Instant::now();
+		while start.elapsed() < Duration::from_micros(us as u64) {}
+	}
+
+	fn read(&mut self, timeout: u32) -> Result<Frame, i16> {
+		canlib::read(self.handle, timeout)
+	}
+
+	fn flush(&mut self) {
+		unsafe {canlib::canFlushReceiveQueue(self.handle)};
+	}
+
+	fn set_params(&mut self, freq: i32, tseg1: u32, tseg2: u32, sjw: u32) -> i16 {
+		let samples = if tseg1 == 0 { 0 } else { 1 };
+		unsafe {canlib::canSetBusParams(self.handle, freq as c_long, tseg1, tseg2, sjw, samples, 0)}
+	}
+
+	fn error_counters(&mut self) -> (u32, u32, u32) {
+		canlib::error_counters(self.handle)
+	}
+
+	fn clock(&mut self) -> u64 {
+		let elapsed = self.opened.elapsed();
+		elapsed.as_secs() * 1000000 + (elapsed.subsec_nanos() / 1000) as u64
+	}
+
+	fn bus_load(&mut self) -> Option<f64> {
+		canlib::bus_load(self.handle)
+	}
+}
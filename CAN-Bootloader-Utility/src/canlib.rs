@@ -0,0 +1,83 @@
+// Kvaser CANlib bindings
+use libc::*;
+
+pub const NO_TIMEOUT: u32 = 0xFFFFFFFF;
+pub const ERROR_OK: i16 = 0;
+
+// Frame flags reported by canReadWait
+pub const MSG_ERROR_FRAME: c_uint = 0x0020;
+pub const MSGERR_MASK: c_uint = 0xFF00;
+
+#[link(name = "canlib32")]
+extern {
+	pub fn canOpenChannel(ctrl: u16, flags: u16) -> i16;
+	pub fn canInitializeLibrary();
+	pub fn canSetBusParams(handle: i16, bitrate: c_long, tseg1: c_uint, tseg2: c_uint, sjw: c_uint, noSamp: c_uint, syncmode: c_uint) -> i16;
+	pub fn canWriteWait(handle: i16, id: u32, msg: *const c_void, dlc: u16, flag: u16, timeout: u32) -> i16;
+	pub fn canBusOn(handle: i16) -> i16;
+	pub fn canClose(handle: i16) -> i16;
+	pub fn canReadWait(handle: i16, id: *mut c_long, msg: *mut c_void, dlc: *mut c_uint, flag: *mut c_uint, time: *mut c_ulong, timeout: c_ulong) -> i16;
+	pub fn canFlushReceiveQueue(handle: i16) -> i16;
+	pub fn canReadErrorCounters(handle: i16, txErr: *mut c_uint, rxErr: *mut c_uint, ovErr: *mut c_uint) -> i16;
+	pub fn canRequestBusStatistics(handle: i16) -> i16;
+	pub fn canGetBusStatistics(handle: i16, stat: *mut BusStatistics, bufsiz: size_t) -> i16;
+}
+
+// canBusStatistics
+#[repr(C)]
+#[derive(Default)]
+pub struct BusStatistics {
+	pub std_data: c_ulong,
+	pub std_remote: c_ulong,
+	pub ext_data: c_ulong,
+	pub ext_remote: c_ulong,
+	pub err_frame: c_ulong,
+	pub bus_load: c_ulong,		// 0 to 10000 for 0.00% to 100.00%
+	pub overruns: c_ulong,
+}
+
+pub struct Frame {
+	pub id: i32,
+	pub data: [u8; 8],
+	pub flags: u32,
+}
+
+// Next frame in the receive queue, waiting up to timeout ms. Error frames
+// are returned too, see MSG_ERROR_FRAME.
+pub fn read(handle: i16, timeout: u32) -> Result<Frame, i16> {
+	let mut id: c_long = 0;
+	let mut data: [u8; 8] = [0; 8];
+	let mut dlc: c_uint = 0;
+	let mut flags: c_uint = 0;
+	let mut time: c_ulong = 0;
+	let result = unsafe {canReadWait(handle, &mut id, data.as_mut_ptr() as *mut c_void, &mut dlc, &mut flags, &mut time, timeout as c_ulong)};
+	if result != ERROR_OK {
+		return Err(result);
+	}
+	Ok(Frame { id: id as i32, data: data, flags: flags as u32 })
+}
+
+pub fn write(handle: i16, id: u32, data: &[u8]) -> i16 {
+	unsafe {canWriteWait(handle, id, data.as_ptr() as *const c_void, data.len() as u16, 0, 10000)}
+}
+
+// Transmit, receive and overrun error counters
+pub fn error_counters(handle: i16) -> (u32, u32, u32) {
+	let mut tx: c_uint = 0;
+	let mut rx: c_uint = 0;
+	let mut ov: c_uint = 0;
+	unsafe {canReadErrorCounters(handle, &mut tx, &mut rx, &mut ov)};
+	(tx as u32, rx as u32, ov as u32)
+}
+
+// Bus load since the last call. The interface measures it between two
+// requests, so the first call starts the measurement and returns None.
+pub fn bus_load(handle: i16) -> Option<f64> {
+	let mut stats = BusStatistics::default();
+	let result = unsafe {canGetBusStatistics(handle, &mut stats, ::std::mem::size_of::<BusStatistics>())};
+	let requested = unsafe {canRequestBusStatistics(handle)};
+	if result != ERROR_OK || requested != ERROR_OK || stats.std_data + stats.ext_data == 0 {
+		return None;
+	}
+	Some(stats.bus_load as f64 / 10000.0)
+}
@@ -0,0 +1,123 @@
+// Backup of the application a device runs (-dump), read over CAN with the
+// loader's READ command before anything is erased. It is saved as an ASCII
+// boot file, so -i takes it back to restore it with a later bootload into
+// the same slot.
+use std::cmp::min;
+use std::collections::VecDeque;
+use std::fs::File;
+use std::io::Write;
+use bus::Bus;
+use loader;
+use protocol;
+use image;
+
+// Frames of four words per READ, and READs kept in flight
+const BLOCK_FRAMES: u8 = 64;
+const READS_IN_FLIGHT: usize = 2;
+const MAX_RETRIES: u32 = 3;
+const REPLY_TIMEOUT: u32 = 100;
+
+const APP_HEADER_WORDS: usize = 16;
+const FLASH_SUCCESS: u16 = 0xAAAA;
+
+// Save the application in the slot at slot_start to path. Returns the
+// words saved.
+pub fn backup(channel: &mut dyn Bus, slot_start: u32, path: &str, errors: &mut u32) -> Result<usize, String> {
+	// struct APP_HEADER, 32 bit fields low word first
+	let header = read(channel, slot_start, APP_HEADER_WORDS, errors)?;
+	if header[0] != FLASH_SUCCESS {
+		return Err(format!("slot at {:#x} holds no complete application", slot_start));
+	}
+	let long = |k: usize| header[k] as u32 | (header[k + 1] as u32) << 16;
+	let (crc, start, length, entry) = (header[1], long(2), long(4), long(8));
+	let words = read(channel, start, length as usize, errors)?;
+	if image::crc16_ccitt(&words) != crc {
+		return Err(String::from("the application read back does not match its CRC"));
+	}
+	save(path, entry, start, &words)?;
+	Ok(words.len())
+}
+
+// length words from addr, with READS_IN_FLIGHT READs outstanding to keep
+// the bus busy. A block that comes back short or with a bad CRC is read
+// again, after the rest in flight has arrived. READs go by whole frames of
+// four words, so they start on a four word boundary and the words before
+// addr are dropped. The last frame then ends by the end of the slot, which
+// the loader will not read past.
+fn read(channel: &mut dyn Bus, addr: u32, length: usize, errors: &mut u32) -> Result<Vec<u16>, String> {
+	let skip = (addr & 3) as usize;
+	let end = addr + length as u32;
+	let mut words = Vec::with_capacity(skip + length + 4 * BLOCK_FRAMES as usize);
+	let mut pending = VecDeque::new();
+	let mut next = addr - skip as u32;
+	let mut retries = 0;
+	while words.len() < skip + length {
+		while pending.len() < READS_IN_FLIGHT && next < end {
+			let frames = min(BLOCK_FRAMES as u32, (end - next + 3) / 4) as u8;
+			let result = channel.write(protocol::DATA_ID, &protocol::read_frame(next, frames));
+			if result != 0 {
+				return Err(format!("Unable to send READ. Error: {}", result));
+			}
+			pending.push_back((next, frames));
+			next += 4 * frames as u32;
+		}
+		let (block_addr, frames) = pending.pop_front().unwrap();
+		match read_block(channel, frames, errors) {
+			Some(block) => words.extend_from_slice(&block),
+			None => {
+				retries += 1;
+				if retries > MAX_RETRIES {
+					return Err(format!("read of {:#x} failed {} times", block_addr, retries));
+				}
+				while loader::read_reply(channel, REPLY_TIMEOUT, errors).is_some() {}
+				pending.clear();
+				next = block_addr;
+			}
+		}
+	}
+	words.drain(..skip);
+	words.truncate(length);
+	Ok(words)
+}
+
+// Words of one READ, if they all came and match the CRC in its ACK
+fn read_block(channel: &mut dyn Bus, frames: u8, errors: &mut u32) -> Option<Vec<u16>> {
+	let mut block = Vec::with_capacity(4 * frames as usize);
+	for _ in 0..frames {
+		let reply = loader::read_reply(channel, REPLY_TIMEOUT, errors)?;
+		block.extend_from_slice(&[reply.arg, reply.status, (reply.data >> 16) as u16, reply.data as u16]);
+	}
+	let ack = loader::read_reply(channel, REPLY_TIMEOUT, errors)?;
+	if ack.arg == protocol::CMD_READ as u16 && ack.status == protocol::STATUS_ACK && ack.data as u16 == image::crc16_ccitt(&block) {
+		Some(block)
+	}
+	else {
+		None
+	}
+}
+
+// Boot stream with words as one block at start, written the way hex2000
+// -boot -a does: STX, the stream bytes in hex, each word LSB first, ETX
+fn save(path: &str, entry: u32, start: u32, words: &[u16]) -> Result<(), String> {
+	let mut stream = vec![image::KEY_VALUE, 0, 0, 0, 0, 0, 0, 0, 0, (entry >> 16) as u16, entry as u16,
+		words.len() as u16, (start >> 16) as u16, start as u16];
+	stream.extend_from_slice(words);
+	stream.push(0);
+
+	let mut text = String::from("\x02\n");
+	for line in stream.chunks(12) {
+		let bytes: Vec<String> = line.iter().map(|word| format!("{:02X} {:02X}", word & 0xFF, word >> 8)).collect();
+		text.push_str(&bytes.join(" "));
+		text.push('\n');
+	}
+	text.push('\x03');
+
+	let mut file = match File::create(path) {
+		Ok(file) => file,
+		Err(e) => return Err(format!("Unable to create {}. Error: {}", path, e)),
+	};
+	match file.write_all(text.as_bytes()) {
+		Ok(()) => Ok(()),
+		Err(e) => Err(format!("Unable to write {}. Error: {}", path, e)),
+	}
+}
@@ -0,0 +1,136 @@
+// Machine readable output (-json): one JSON object per line on stdout. The
+// usual progress text moves to stderr while it is on.
+use std::fmt::Display;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::time::Duration;
+
+const TEXT: usize = 0;
+const JSON: usize = 1;
+const SILENT: usize = 2;	// Neither, for -bench
+
+static MODE: AtomicUsize = AtomicUsize::new(TEXT);
+
+pub fn enable() {
+	MODE.store(JSON, Ordering::Relaxed);
+}
+
+pub fn enabled() -> bool {
+	MODE.load(Ordering::Relaxed) == JSON
+}
+
+pub fn silence() {
+	MODE.store(SILENT, Ordering::Relaxed);
+}
+
+pub fn silent() -> bool {
+	MODE.load(Ordering::Relaxed) == SILENT
+}
+
+pub fn millis(duration: Duration) -> u64 {
+	duration.as_secs() * 1000 + (duration.subsec_nanos() / 1000000) as u64
+}
+
+// Builder for one event record. Every record starts with its event name.
+pub struct Record {
+	text: String,
+}
+
+impl Record {
+	pub fn new(event: &str) -> Record {
+		Record::object().str("event", event)
+	}
+
+	// Object nested in a record
+	pub fn object() -> Record {
+		Record { text: String::from("{") }
+	}
+
+	fn key(&mut self, key: &str) {
+		if self.text.len() > 1 {
+			self.text.push(',');
+		}
+		self.text.push('"');
+		self.text.push_str(key);
+		self.text.push_str("\":");
+	}
+
+	pub fn str(mut self, key: &str, value: &str) -> Record {
+		self.key(key);
+		self.text.push_str(&quote(value));
+		self
+	}
+
+	pub fn num<T: Display>(mut self, key: &str, value: T) -> Record {
+		self.key(key);
+		self.text.push_str(&value.to_string());
+		self
+	}
+
+	// Rates and the like, null when not a number
+	pub fn float(mut self, key: &str, value: f64) -> Record {
+		self.key(key);
+		if value.is_finite() {
+			self.text.push_str(&format!("{:.1}", value));
+		}
+		else {
+			self.text.push_str("null");
+		}
+		self
+	}
+
+	pub fn flag(mut self, key: &str, value: bool) -> Record {
+		self.key(key);
+		self.text.push_str(if value { "true" } else { "false" });
+		self
+	}
+
+	pub fn null(mut self, key: &str) -> Record {
+		self.key(key);
+		self.text.push_str("null");
+		self
+	}
+
+	// Nested object
+	pub fn record(mut self, key: &str, value: Record) -> Record {
+		self.key(key);
+		self.text.push_str(&value.finish());
+		self
+	}
+
+	pub fn list(mut self, key: &str, values: Vec<Record>) -> Record {
+		self.key(key);
+		let items: Vec<String> = values.into_iter().map(|value| value.finish()).collect();
+		self.text.push('[');
+		self.text.push_str(&items.join(","));
+		self.text.push(']');
+		self
+	}
+
+	// Write the record as one line, if -json is on
+	pub fn emit(self) {
+		if enabled() {
+			println!("{}", self.finish());
+		}
+	}
+
+	fn finish(mut self) -> String {
+		self.text.push('}');
+		self.text
+	}
+}
+
+fn quote(value: &str) -> String {
+	let mut text = String::with_capacity(value.len() + 2);
+	text.push('"');
+	for c in value.chars() {
+		match c {
+			'"' => text.push_str("\\\""),
+			'\\' => text.push_str("\\\\"),
+			'\n' => text.push_str("\\n"),
+			c if (c as u32) < 0x20 => text.push_str(&format!("\\u{:04x}", c as u32)),
+			c => text.push(c),
+		}
+	}
+	text.push('"');
+	text
+}
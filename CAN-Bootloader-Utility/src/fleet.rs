@@ -0,0 +1,91 @@
+// Fleet flashing: one worker thread per CAN channel, each taking the next
+// device from a shared queue whenever it is idle. Every worker sends from
+// the same decoded images, so memory use does not grow with the number of
+// devices flashed.
+use std::collections::VecDeque;
+use std::sync::{Arc, Mutex};
+use std::thread;
+use std::time::{Duration, Instant};
+use canlib;
+use bus::Channel;
+use image::Image;
+use session;
+use session::{Options, Stats};
+
+// Results for one channel
+pub struct Report {
+	pub bus: u16,
+	pub flashed: Vec<u32>,
+	pub failed: Vec<(u32, String)>,
+	pub stats: Stats,
+	pub elapsed: Duration,
+}
+
+impl Report {
+	pub fn seconds(&self) -> f64 {
+		self.elapsed.as_secs() as f64 + self.elapsed.subsec_nanos() as f64 / 1e9
+	}
+
+	pub fn frames_per_second(&self) -> f64 {
+		let seconds = self.seconds();
+		if seconds > 0.0 { self.stats.frames as f64 / seconds } else { 0.0 }
+	}
+}
+
+// Flash every device in devices over the given channels and return one
+// report per channel, in channel order
+pub fn run(buses: &[u16], devices: Vec<u32>, images: Arc<Vec<Image>>, options: Arc<Options>) -> Vec<Report> {
+	let queue = Arc::new(Mutex::new(devices.into_iter().collect::<VecDeque<u32>>()));
+
+	let workers: Vec<_> = buses.iter().map(|&bus| {
+		let queue = queue.clone();
+		let images = images.clone();
+		let options = options.clone();
+		thread::spawn(move || worker(bus, &queue, &images, &options))
+	}).collect();
+
+	workers.into_iter().zip(buses).map(|(worker, &bus)| {
+		worker.join().unwrap_or_else(|_| Report {
+			bus: bus,
+			flashed: Vec::new(),
+			failed: vec![(0, String::from("worker thread panicked"))],
+			stats: Stats::default(),
+			elapsed: Duration::from_secs(0),
+		})
+	}).collect()
+}
+
+fn worker(bus: u16, queue: &Mutex<VecDeque<u32>>, images: &[Image], options: &Options) -> Report {
+	let start = Instant::now();
+	let mut report = Report { bus: bus, flashed: Vec::new(), failed: Vec::new(), stats: Stats::default(), elapsed: Duration::from_secs(0) };
+
+	let mut channel = match Channel::open(bus, options.bitrate) {
+		Ok(channel) => channel,
+		Err(e) => {
+			// Leave the queue to the other channels
+			note!("[bus {}] {}", bus, e);
+			return report;
+		}
+	};
+
+	loop {
+		let device = match queue.lock().unwrap().pop_front() {
+			Some(device) => device,
+			None => break,
+		};
+		match session::bootload(&mut channel, bus, device, images, options, &mut report.stats) {
+			Ok(()) => report.flashed.push(device),
+			Err(e) => {
+				note!("[bus {}, device {}] {}", bus, device, e);
+				report.failed.push((device, e));
+			}
+		}
+	}
+
+	let result = channel.close();
+	if result != canlib::ERROR_OK {
+		note!("[bus {}] Failed to close bus. Error: {}", bus, result);
+	}
+	report.elapsed = start.elapsed();
+	report
+}
@@ -0,0 +1,74 @@
+// Boot stream data frames, built once per image and frame format. Every
+// attempt and every channel sends slices of the same ring, so the send loop
+// does no formatting or allocation.
+
+const FRAME_SIZE: usize = 8;
+
+pub struct FrameRing {
+	data: Vec<u8>,		// FRAME_SIZE bytes per frame
+	dlc: Vec<u8>,
+	words_per_frame: usize,
+}
+
+impl FrameRing {
+	// Sequence number, then up to 3 words LSB first. The sequence number
+	// is the low half of the frame's position, counted from 1.
+	pub fn build(words: &[u16], words_per_frame: usize) -> FrameRing {
+		let frames = (words.len() + words_per_frame - 1) / words_per_frame;
+		let mut data = vec![0u8; frames * FRAME_SIZE];
+		let mut dlc = Vec::with_capacity(frames);
+		for (index, chunk) in words.chunks(words_per_frame).enumerate() {
+			let count = (index + 1) as u16;
+			let frame = &mut data[index * FRAME_SIZE..(index + 1) * FRAME_SIZE];
+			frame[0] = (count >> 8) as u8;
+			frame[1] = count as u8;
+			for (slot, word) in chunk.iter().enumerate() {
+				frame[2 + slot * 2] = *word as u8;
+				frame[3 + slot * 2] = (*word >> 8) as u8;
+			}
+			dlc.push((2 + chunk.len() * 2) as u8);
+		}
+		FrameRing { data: data, dlc: dlc, words_per_frame: words_per_frame }
+	}
+
+	pub fn len(&self) -> usize {
+		self.dlc.len()
+	}
+
+	// Payload bytes over every frame
+	pub fn bytes(&self) -> u64 {
+		self.dlc.iter().map(|&dlc| dlc as u64).sum()
+	}
+
+	// Boot stream words sent before frame index
+	pub fn words_before(&self, index: usize) -> usize {
+		index * self.words_per_frame
+	}
+
+	pub fn frame(&self, index: usize) -> &[u8] {
+		let start = index * FRAME_SIZE;
+		&self.data[start..start + self.dlc[index] as usize]
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use super::*;
+
+	#[test]
+	fn frames_carry_sequence_and_words_lsb_first() {
+		let ring = FrameRing::build(&[0x1122, 0x3344, 0x5566, 0x7788, 0x99AA], 3);
+		assert_eq!(ring.len(), 2);
+		assert_eq!(ring.frame(0), &[0, 1, 0x22, 0x11, 0x44, 0x33, 0x66, 0x55][..]);
+		assert_eq!(ring.frame(1), &[0, 2, 0x88, 0x77, 0xAA, 0x99][..]);
+	}
+
+	#[test]
+	fn sequence_is_the_low_half_of_the_position() {
+		let words = vec![0u16; 0x10001];
+		let ring = FrameRing::build(&words, 1);
+		assert_eq!(ring.frame(0xFFFE)[..2], [0xFF, 0xFF]);
+		assert_eq!(ring.frame(0xFFFF)[..2], [0, 0]);
+		assert_eq!(ring.frame(0xFFFF).len(), 4);
+	}
+}
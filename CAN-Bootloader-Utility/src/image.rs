@@ -0,0 +1,517 @@
+use std::io::prelude::*;
+use std::fs::File;
+use std::ops::Range;
+use frames::FrameRing;
+
+// Key value at the start of every 8 bit boot stream
+pub const KEY_VALUE: u16 = 0x08AA;
+
+// Application slots on the F28035, see SLOT_START/SLOT_END in CAN_Boot.c
+pub const SLOT_COUNT: u16 = 2;
+pub const SLOT_RANGES: [(u32, u32); 2] = [(0x3E8000, 0x3EDFFF), (0x3EE000, 0x3F3FFF)];
+// L0 and L1 SARAM, where -ram images go. They have no header.
+pub const RAM_RANGE: (u32, u32) = (0x8000, 0x8BFF);
+const APP_HEADER_SIZE: u32 = 16;
+// 8K word flash sectors, sector A ending at FLASH_TOP
+const SECTOR_WORDS: u32 = 0x2000;
+const FLASH_TOP: u32 = 0x3F7FFF;
+// A block header costs three stream words, so gaps up to that long are
+// sent as words rather than split around
+const BLOCK_OVERHEAD: usize = 3;
+// Largest block size the stream can carry
+const MAX_BLOCK: usize = 0xFFFF;
+
+const CRC16_POLY: u16 = 0x1021;
+const CRC16_INIT: u16 = 0xFFFF;
+
+// Hex digit values, NOT_HEX for STX, ETX, whitespace and anything else
+const NOT_HEX: u8 = 0xFF;
+const HEX_TABLE: [u8; 256] = hex_table();
+
+const fn hex_table() -> [u8; 256] {
+	let mut table = [NOT_HEX; 256];
+	let mut digit = 0;
+	while digit < 16 {
+		if digit < 10 {
+			table[b'0' as usize + digit] = digit as u8;
+		}
+		else {
+			table[b'A' as usize + digit - 10] = digit as u8;
+			table[b'a' as usize + digit - 10] = digit as u8;
+		}
+		digit += 1;
+	}
+	table
+}
+
+pub struct Block {
+	pub addr: u32,
+	pub data: Vec<u16>,
+	pub offset: usize,	// Position of the first data word in the boot stream
+}
+
+// Program decoded from a hex2000 ASCII boot file (-boot -a)
+pub struct Image {
+	pub entry: u32,
+	pub blocks: Vec<Block>,
+	pub sections: usize,	// Blocks in the file, before coalesce()
+	crc: u16,
+	single: FrameRing,	// One word per frame
+	multi: FrameRing,	// Three words per frame
+}
+
+impl Image {
+	pub fn load(path: &str) -> Result<Image, String> {
+		let mut text = Vec::new();
+		match File::open(path) {
+			Ok(mut f) => if let Err(e) = f.read_to_end(&mut text) {
+				return Err(format!("Unable to read program file {}. Error: {}", path, e));
+			},
+			Err(e) => return Err(format!("Unable to open program file {}. Error: {}", path, e)),
+		};
+
+		// Every 4 hex digits form one word, sent LSB first. STX, ETX and
+		// whitespace are skipped.
+		let mut words = Vec::with_capacity(text.len() / 5);
+		let mut word: u16 = 0;
+		let mut nibbles = 0;
+		for byte in &text {
+			let nibble = HEX_TABLE[*byte as usize];
+			if nibble != NOT_HEX {
+				word = (word << 4) | nibble as u16;
+				nibbles += 1;
+				if nibbles == 4 {
+					nibbles = 0;
+					words.push(word.swap_bytes());
+				}
+			}
+		}
+
+		Image::from_words(words).map_err(|e| format!("{}: {}", path, e))
+	}
+
+	pub fn from_words(words: Vec<u16>) -> Result<Image, String> {
+		// Key, 8 reserved words, entry point and at least the terminating block size
+		if words.len() < 12 {
+			return Err(String::from("boot stream is too short"));
+		}
+		if words[0] != KEY_VALUE {
+			return Err(format!("invalid key value {:#06x}", words[0]));
+		}
+		let entry = ((words[9] as u32) << 16) | words[10] as u32;
+
+		let mut blocks = Vec::new();
+		let mut pos = 11;
+		loop {
+			if pos >= words.len() {
+				return Err(String::from("boot stream ends without a zero block size"));
+			}
+			let size = words[pos] as usize;
+			if size == 0 {
+				break;
+			}
+			if pos + 3 + size > words.len() {
+				return Err(String::from("boot stream ends inside a block"));
+			}
+			let addr = ((words[pos + 1] as u32) << 16) | words[pos + 2] as u32;
+			blocks.push(Block { addr: addr, data: words[pos + 3..pos + 3 + size].to_vec(), offset: pos + 3 });
+			pos += 3 + size;
+		}
+
+		let sections = blocks.len();
+		let mut image = Image::build(entry, coalesce(blocks));
+		image.sections = sections;
+		Ok(image)
+	}
+
+	// Boot stream for blocks, in the order given
+	fn build(entry: u32, mut blocks: Vec<Block>) -> Image {
+		let mut words = vec![KEY_VALUE, 0, 0, 0, 0, 0, 0, 0, 0, (entry >> 16) as u16, entry as u16];
+		for b in &mut blocks {
+			words.push(b.data.len() as u16);
+			words.push((b.addr >> 16) as u16);
+			words.push(b.addr as u16);
+			b.offset = words.len();
+			words.extend_from_slice(&b.data);
+		}
+		words.push(0);
+
+		let crc = span_crc16(&blocks);
+		let single = FrameRing::build(&words, 1);
+		let multi = FrameRing::build(&words, 3);
+		let sections = blocks.len();
+		Image { entry: entry, blocks: blocks, sections: sections, crc: crc, single: single, multi: multi }
+	}
+
+	// Data frames for the boot stream at up to words_per_frame words each
+	pub fn frames(&self, words_per_frame: usize) -> &FrameRing {
+		if words_per_frame >= 3 { &self.multi } else { &self.single }
+	}
+
+	// Block and flash address the loader writes next once it has taken word
+	// boot stream words, None while it is still in the stream header
+	pub fn position(&self, word: usize) -> Option<(usize, u32)> {
+		self.blocks.iter().rposition(|b| b.offset <= word).map(|index| {
+			let b = &self.blocks[index];
+			(index, b.addr + ::std::cmp::min(word - b.offset, b.data.len()) as u32)
+		})
+	}
+
+	// Slot this image was linked for, if every block fits in one slot
+	pub fn slot(&self) -> Option<u16> {
+		(0..SLOT_COUNT).find(|&slot| {
+			let (start, end) = SLOT_RANGES[slot as usize];
+			self.fits(start, end)
+		})
+	}
+
+	// True if every block lies between start and end, behind the application header
+	pub fn fits(&self, start: u32, end: u32) -> bool {
+		self.within(start + APP_HEADER_SIZE, end)
+	}
+
+	// True if the image is linked for RAM_RANGE
+	pub fn in_ram(&self) -> bool {
+		self.within(RAM_RANGE.0, RAM_RANGE.1)
+	}
+
+	fn within(&self, first: u32, last: u32) -> bool {
+		!self.blocks.is_empty() && self.blocks.iter().all(|b| {
+			b.addr >= first && b.addr + b.data.len() as u32 <= last + 1
+		})
+	}
+
+	// CRC16 the loader records in the application header, worked out once
+	// when the image is decoded
+	pub fn crc16(&self) -> u16 {
+		self.crc
+	}
+
+	// Program for the slot from start to end when it already holds base.
+	// Sectors this image writes where every word, gaps included, only needs
+	// bits cleared can be programmed without an erase, except the first one,
+	// which holds the header. Returns their SECTORx mask and the image with
+	// the words base already holds there left out, or None if there are none.
+	// Only sectors up to base's last word were erased when base went in, so
+	// only there are the words base does not write known to be 0xFFFF.
+	// Past that the slot may still hold an older image.
+	pub fn patch(&self, base: &Image, start: u32, end: u32) -> Option<(u16, Image)> {
+		if !self.fits(start, end) || !base.fits(start, end) {
+			return None;
+		}
+		let new = self.contents(start, end);
+		let old = base.contents(start, end);
+		let erased = (span(&base.blocks).1 - 1 - start) as usize;
+		let keep = self.sectors(start, end).into_iter()
+			.filter(|&(_, ref words)| words.start <= erased && self.writes(start, words) &&
+				words.clone().all(|k| old[k] & new[k] == new[k]))
+			.fold(0, |mask, (bit, _)| mask | bit);
+		self.without(keep, &old, start)
+	}
+
+	// As patch() when all that is known of the slot is the CRC16 of some of
+	// its sectors, see sector_crcs(). Sectors that hold exactly what this
+	// image writes there are kept and none of their words sent.
+	pub fn reuse(&self, held: &[(u16, u16)], start: u32, end: u32) -> Option<(u16, Image)> {
+		if !self.fits(start, end) {
+			return None;
+		}
+		let new = self.contents(start, end);
+		let keep = self.sectors(start, end).into_iter()
+			.filter(|&(bit, ref words)| self.writes(start, words) && held.contains(&(bit, crc16_ccitt(&new[words.clone()]))))
+			.fold(0, |mask, (bit, _)| mask | bit);
+		self.without(keep, &new, start)
+	}
+
+	// SECTORx bit and CRC16 of the sectors of the slot from start to end
+	// that hold this image and nothing else once it is loaded: all of them
+	// up to its last word, since the loader erases those, but the header
+	// sector
+	pub fn sector_crcs(&self, start: u32, end: u32) -> Vec<(u16, u16)> {
+		if !self.fits(start, end) {
+			return Vec::new();
+		}
+		let new = self.contents(start, end);
+		let last = (span(&self.blocks).1 - 1 - start) as usize;
+		self.sectors(start, end).into_iter()
+			.filter(|&(_, ref words)| words.start <= last)
+			.map(|(bit, words)| (bit, crc16_ccitt(&new[words])))
+			.collect()
+	}
+
+	// Words from the first to the last one written, the length the loader
+	// records in the application header
+	pub fn length(&self) -> u32 {
+		let (first, end) = span(&self.blocks);
+		end - first
+	}
+
+	// SECTORx bit and range in contents() of each sector of the slot from
+	// start to end, but the first
+	fn sectors(&self, start: u32, end: u32) -> Vec<(u16, Range<usize>)> {
+		(1..((end + 1 - start) / SECTOR_WORDS) as usize).map(|sector| {
+			let bit = 1 << ((FLASH_TOP - start) / SECTOR_WORDS - sector as u32);
+			(bit, sector * SECTOR_WORDS as usize..(sector + 1) * SECTOR_WORDS as usize)
+		}).collect()
+	}
+
+	// True if a block writes to the words of contents(start, ...)
+	fn writes(&self, start: u32, words: &Range<usize>) -> bool {
+		self.blocks.iter().any(|b| {
+			let offset = (b.addr - start) as usize;
+			offset < words.end && offset + b.data.len() > words.start
+		})
+	}
+
+	// This image with the words in the keep sectors that old, the contents
+	// from start, already holds left out
+	fn without(&self, keep: u16, old: &[u16], start: u32) -> Option<(u16, Image)> {
+		if keep == 0 {
+			return None;
+		}
+
+		// The first and last words stay so the loader records the same span
+		let (first, end) = span(&self.blocks);
+		let last = end - 1;
+		let needed = |addr: u32, word: u16| {
+			let bit = 1 << ((FLASH_TOP - addr) / SECTOR_WORDS);
+			keep & bit == 0 || word != old[(addr - start) as usize] || addr == first || addr == last
+		};
+
+		let mut blocks = Vec::new();
+		for b in &self.blocks {
+			let mut k = 0;
+			while k < b.data.len() {
+				if !needed(b.addr + k as u32, b.data[k]) {
+					k += 1;
+					continue;
+				}
+				// Extend the run over gaps too short to be worth a new block
+				let mut run = k + 1;
+				let mut gap = 0;
+				while run + gap < b.data.len() && gap <= BLOCK_OVERHEAD {
+					if needed(b.addr + (run + gap) as u32, b.data[run + gap]) {
+						run += gap + 1;
+						gap = 0;
+					}
+					else {
+						gap += 1;
+					}
+				}
+				blocks.push(Block { addr: b.addr + k as u32, data: b.data[k..run].to_vec(), offset: 0 });
+				k = run;
+			}
+		}
+
+		// Not coalesced, filling the gaps would set bits. Words left out read
+		// back as base's, so the CRC is unchanged.
+		let mut patched = Image::build(self.entry, blocks);
+		patched.crc = self.crc;
+		Some((keep, patched))
+	}
+
+	// Words of the range from start to end as programmed, erased where
+	// no block writes
+	fn contents(&self, start: u32, end: u32) -> Vec<u16> {
+		let mut words = vec![0xFFFFu16; (end + 1 - start) as usize];
+		for b in &self.blocks {
+			for (k, word) in b.data.iter().enumerate() {
+				let addr = b.addr + k as u32;
+				if addr >= start && addr <= end {
+					words[(addr - start) as usize] = *word;
+				}
+			}
+		}
+		words
+	}
+}
+
+// Blocks in address order, so the loader programs and erases one sector
+// after the other, with blocks that touch or are up to BLOCK_OVERHEAD words
+// apart merged and the gap filled with erased words. hex2000 emits sections
+// in link order, often many small ones. Overlapping blocks are left as they
+// are, since their order decides what ends up in flash.
+fn coalesce(mut blocks: Vec<Block>) -> Vec<Block> {
+	let end = |b: &Block| b.addr + b.data.len() as u32;
+	let mut spans: Vec<(u32, u32)> = blocks.iter().map(|b| (b.addr, end(b))).collect();
+	spans.sort();
+	if spans.windows(2).any(|pair| pair[1].0 < pair[0].1) {
+		return blocks;
+	}
+	blocks.sort_by_key(|b| b.addr);
+
+	let mut merged: Vec<Block> = Vec::with_capacity(blocks.len());
+	for b in blocks {
+		if let Some(last) = merged.last_mut() {
+			let gap = (b.addr - end(last)) as usize;
+			if gap <= BLOCK_OVERHEAD && last.data.len() + gap + b.data.len() <= MAX_BLOCK {
+				last.data.extend(::std::iter::repeat(0xFFFF).take(gap));
+				last.data.extend_from_slice(&b.data);
+				continue;
+			}
+		}
+		merged.push(b);
+	}
+	merged
+}
+
+// First address written and the one after the last
+fn span(blocks: &[Block]) -> (u32, u32) {
+	let start = blocks.iter().map(|b| b.addr).min().unwrap_or(0);
+	let end = blocks.iter().map(|b| b.addr + b.data.len() as u32).max().unwrap_or(0);
+	(start, end)
+}
+
+// CRC-16/CCITT over the span from the first to the last word written, gaps
+// read as erased flash
+fn span_crc16(blocks: &[Block]) -> u16 {
+	let (start, end) = span(blocks);
+	let mut span = vec![0xFFFFu16; (end - start) as usize];
+	for b in blocks {
+		let offset = (b.addr - start) as usize;
+		span[offset..offset + b.data.len()].copy_from_slice(&b.data);
+	}
+	crc16_ccitt(&span)
+}
+
+// CRC16_Calc() in CAN_Boot.c: CRC-16/CCITT, each word MSB first
+pub fn crc16_ccitt(words: &[u16]) -> u16 {
+	let mut crc = CRC16_INIT;
+	for word in words {
+		for byte in &[(*word >> 8) as u8, *word as u8] {
+			crc ^= (*byte as u16) << 8;
+			for _ in 0..8 {
+				crc = if crc & 0x8000 != 0 { (crc << 1) ^ CRC16_POLY } else { crc << 1 };
+			}
+		}
+	}
+	crc
+}
+
+#[cfg(test)]
+mod tests {
+	use super::*;
+
+	const SLOT: (u32, u32) = SLOT_RANGES[0];
+	// SECTORx bits of the second and third sector of slot 0
+	const SECTOR_G: u16 = 0x40;
+	const SECTOR_F: u16 = 0x20;
+
+	fn block(addr: u32, data: Vec<u16>) -> Block {
+		Block { addr: addr, data: data, offset: 0 }
+	}
+
+	// Boot stream for blocks, as hex2000 would emit them
+	fn stream(entry: u32, blocks: &[(u32, Vec<u16>)]) -> Vec<u16> {
+		let mut words = vec![KEY_VALUE, 0, 0, 0, 0, 0, 0, 0, 0, (entry >> 16) as u16, entry as u16];
+		for &(addr, ref data) in blocks {
+			words.push(data.len() as u16);
+			words.push((addr >> 16) as u16);
+			words.push(addr as u16);
+			words.extend_from_slice(data);
+		}
+		words.push(0);
+		words
+	}
+
+	fn image(blocks: &[(u32, Vec<u16>)]) -> Image {
+		Image::from_words(stream(SLOT.0 + 0x10, blocks)).unwrap()
+	}
+
+	#[test]
+	fn crc16_ccitt_check_value() {
+		assert_eq!(crc16_ccitt(&[]), CRC16_INIT);
+		// CRC-16/CCITT-FALSE of "12345678"
+		assert_eq!(crc16_ccitt(&[0x3132, 0x3334, 0x3536, 0x3738]), 0xA12B);
+	}
+
+	#[test]
+	fn coalesce_sorts_and_fills_short_gaps() {
+		let merged = coalesce(vec![
+			block(0x8010, vec![3]),
+			block(0x8000, vec![1, 2]),
+			block(0x8005, vec![4]),
+		]);
+		assert_eq!(merged.len(), 2);
+		assert_eq!(merged[0].addr, 0x8000);
+		assert_eq!(merged[0].data, vec![1, 2, 0xFFFF, 0xFFFF, 0xFFFF, 4]);
+		assert_eq!(merged[1].addr, 0x8010);
+		assert_eq!(merged[1].data, vec![3]);
+	}
+
+	#[test]
+	fn coalesce_leaves_overlapping_blocks() {
+		let merged = coalesce(vec![block(0x8002, vec![1, 2]), block(0x8000, vec![3, 4, 5])]);
+		assert_eq!(merged.iter().map(|b| b.addr).collect::<Vec<u32>>(), vec![0x8002, 0x8000]);
+	}
+
+	#[test]
+	fn crc_covers_gaps_as_erased() {
+		let start = SLOT.0 + 0x10;
+		let split = image(&[(start, vec![1]), (start + 10, vec![2])]);
+		let mut filled = vec![0xFFFFu16; 11];
+		filled[0] = 1;
+		filled[10] = 2;
+		assert_eq!(split.crc16(), crc16_ccitt(&filled));
+		assert_eq!(split.length(), 11);
+	}
+
+	#[test]
+	fn sector_crcs_skip_the_header_sector_and_stop_at_the_last_word() {
+		let g = SLOT.0 + SECTOR_WORDS;
+		let img = image(&[(SLOT.0 + 0x10, vec![1, 2]), (g + 4, vec![0x1234])]);
+		let crcs = img.sector_crcs(SLOT.0, SLOT.1);
+		let mut sector = vec![0xFFFFu16; SECTOR_WORDS as usize];
+		sector[4] = 0x1234;
+		assert_eq!(crcs, vec![(SECTOR_G, crc16_ccitt(&sector))]);
+	}
+
+	#[test]
+	fn patch_keeps_sectors_that_only_clear_bits() {
+		let g = SLOT.0 + SECTOR_WORDS;
+		let base = image(&[(SLOT.0 + 0x10, vec![1]), (g, vec![0xFFFF, 0x00FF, 0xFFFF])]);
+		let new = image(&[(SLOT.0 + 0x10, vec![2]), (g, vec![0xFFFF, 0x000F, 0x00FF])]);
+		let (keep, patched) = new.patch(&base, SLOT.0, SLOT.1).unwrap();
+		assert_eq!(keep, SECTOR_G);
+		assert_eq!(patched.crc16(), new.crc16());
+		// The header sector word and the changed words are still sent
+		let sent: usize = patched.blocks.iter().map(|b| b.data.len()).sum();
+		assert!(sent < new.blocks.iter().map(|b| b.data.len()).sum::<usize>());
+		assert!(patched.blocks.iter().any(|b| b.addr == SLOT.0 + 0x10));
+	}
+
+	#[test]
+	fn patch_does_not_keep_sectors_that_set_bits() {
+		let g = SLOT.0 + SECTOR_WORDS;
+		let base = image(&[(SLOT.0 + 0x10, vec![1]), (g, vec![0x0000])]);
+		let new = image(&[(SLOT.0 + 0x10, vec![1]), (g, vec![0x0001])]);
+		assert!(new.patch(&base, SLOT.0, SLOT.1).is_none());
+	}
+
+	#[test]
+	fn patch_does_not_keep_sectors_past_the_base() {
+		// G was not erased when base went in, it may hold anything
+		let g = SLOT.0 + SECTOR_WORDS;
+		let base = image(&[(SLOT.0 + 0x10, vec![1; 4])]);
+		let new = image(&[(SLOT.0 + 0x10, vec![1; 4]), (g, vec![0x1234])]);
+		assert!(new.patch(&base, SLOT.0, SLOT.1).is_none());
+
+		// Up to its last word it was
+		let base = image(&[(SLOT.0 + 0x10, vec![1; 4]), (g + 8, vec![0xFFFF])]);
+		assert_eq!(new.patch(&base, SLOT.0, SLOT.1).unwrap().0, SECTOR_G);
+	}
+
+	#[test]
+	fn reuse_keeps_sectors_with_matching_crcs() {
+		let g = SLOT.0 + SECTOR_WORDS;
+		let f = g + SECTOR_WORDS;
+		let img = image(&[(SLOT.0 + 0x10, vec![1]), (g, vec![5; 8]), (f, vec![6; 8])]);
+		let held = img.sector_crcs(SLOT.0, SLOT.1);
+		let (keep, patched) = img.reuse(&held, SLOT.0, SLOT.1).unwrap();
+		assert_eq!(keep, SECTOR_G | SECTOR_F);
+		assert_eq!(patched.crc16(), img.crc16());
+
+		let stale: Vec<(u16, u16)> = held.iter().map(|&(bit, crc)| (bit, crc ^ 1)).collect();
+		assert!(img.reuse(&stale, SLOT.0, SLOT.1).is_none());
+	}
+}
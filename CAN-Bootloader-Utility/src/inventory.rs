@@ -0,0 +1,197 @@
+// Local record of what each device holds (-inventory file), so sectors that
+// already hold the new image can be found without reading the device. It is
+// updated after every successful bootload. One line per device and slot:
+//
+//   device slot crc length caps sectors
+//   487 1 a250 3ff0 ca063f3f C:1b2e,D:93c0
+//
+// crc and length are those of the application header, caps is BOOT_CAPS
+// from the heartbeat and sectors the CRC16 of each sector the image fills,
+// all hex. The slot the device last took is listed last.
+use std::collections::BTreeMap;
+use std::fs::File;
+use std::io::{ErrorKind, Read, Write};
+use image;
+use image::Image;
+use protocol;
+
+pub struct Slot {
+	pub crc: u16,
+	pub length: u32,
+	pub sectors: Vec<(u16, u16)>,	// SECTORx bit, CRC16
+}
+
+#[derive(Default)]
+pub struct Device {
+	pub caps: u32,
+	pub slots: [Option<Slot>; 2],
+	pub active: Option<u16>,		// Slot written last
+}
+
+pub struct Inventory {
+	path: String,
+	devices: BTreeMap<u32, Device>,
+}
+
+impl Inventory {
+	// An inventory that does not exist yet starts out empty
+	pub fn load(path: &str) -> Result<Inventory, String> {
+		let mut inventory = Inventory { path: path.to_string(), devices: BTreeMap::new() };
+		let mut text = String::new();
+		match File::open(path) {
+			Ok(mut f) => if let Err(e) = f.read_to_string(&mut text) {
+				return Err(format!("Unable to read inventory {}. Error: {}", path, e));
+			},
+			Err(ref e) if e.kind() == ErrorKind::NotFound => return Ok(inventory),
+			Err(e) => return Err(format!("Unable to open inventory {}. Error: {}", path, e)),
+		}
+
+		for (number, line) in text.lines().enumerate() {
+			let line = line.trim();
+			if line.is_empty() || line.starts_with('#') {
+				continue;
+			}
+			if !inventory.parse(line) {
+				return Err(format!("{}:{}: bad inventory line", path, number + 1));
+			}
+		}
+		Ok(inventory)
+	}
+
+	fn parse(&mut self, line: &str) -> bool {
+		let fields: Vec<&str> = line.split_whitespace().collect();
+		if fields.len() < 5 || fields.len() > 6 {
+			return false;
+		}
+		let device = fields[0].parse::<u32>();
+		let slot = fields[1].parse::<u16>();
+		let crc = u16::from_str_radix(fields[2], 16);
+		let length = u32::from_str_radix(fields[3], 16);
+		let caps = u32::from_str_radix(fields[4], 16);
+		let (device, slot, crc, length, caps) = match (device, slot, crc, length, caps) {
+			(Ok(device), Ok(slot), Ok(crc), Ok(length), Ok(caps)) if slot < image::SLOT_COUNT => (device, slot, crc, length, caps),
+			_ => return false,
+		};
+		let mut sectors = Vec::new();
+		for item in fields.get(5).map_or("", |f| *f).split(',').filter(|item| !item.is_empty()) {
+			let mut parts = item.splitn(2, ':');
+			let letter = parts.next().unwrap_or("").bytes().next().unwrap_or(0);
+			match u16::from_str_radix(parts.next().unwrap_or(""), 16) {
+				Ok(crc) if letter >= b'A' && letter <= b'H' => sectors.push((1 << (letter - b'A'), crc)),
+				_ => return false,
+			}
+		}
+		self.record(device, caps, slot, Slot { crc: crc, length: length, sectors: sectors });
+		true
+	}
+
+	pub fn save(&self) -> Result<(), String> {
+		let mut text = String::from("# device slot crc length caps sectors\n");
+		for (device, entry) in &self.devices {
+			// The active slot last, so it is active again when loaded
+			let order = match entry.active {
+				Some(active) => [active ^ 1, active],
+				None => [0, 1],
+			};
+			for &slot in &order {
+				if let Some(ref held) = entry.slots[slot as usize] {
+					let sectors: Vec<String> = held.sectors.iter().map(|&(bit, crc)| {
+						format!("{}:{:04x}", (b'A' + bit.trailing_zeros() as u8) as char, crc)
+					}).collect();
+					text.push_str(&format!("{} {} {:04x} {:x} {:08x} {}\n",
+						device, slot, held.crc, held.length, entry.caps, sectors.join(",")));
+				}
+			}
+		}
+		let mut file = match File::create(&self.path) {
+			Ok(file) => file,
+			Err(e) => return Err(format!("Unable to create inventory {}. Error: {}", self.path, e)),
+		};
+		match file.write_all(text.as_bytes()) {
+			Ok(()) => Ok(()),
+			Err(e) => Err(format!("Unable to write inventory {}. Error: {}", self.path, e)),
+		}
+	}
+
+	pub fn device(&self, device: u32) -> Option<&Device> {
+		self.devices.get(&device)
+	}
+
+	// Bootload of device worked out before the bus session: the slot it
+	// will ask for, the sectors there that already hold the image, and the
+	// frames to send against the full image's. None if it is not listed.
+	pub fn plan(&self, device: u32, images: &[Image]) -> Option<(u16, u16, usize, usize)> {
+		let entry = self.devices.get(&device)?;
+		let caps = protocol::Caps::from_word(entry.caps);
+		let slot = entry.active.map_or(0, |active| active ^ 1);
+		let (start, end) = image::SLOT_RANGES[slot as usize];
+		let image = images.iter().find(|image| image.fits(start, end))?;
+		let frames = image.frames(caps.words_per_frame()).len();
+		let patch = if caps.supports(protocol::MODE_KEEP) && caps.supports(protocol::MODE_SLOT_CRC) {
+			entry.slots[slot as usize].as_ref().and_then(|held| image.reuse(&held.sectors, start, end))
+		}
+		else {
+			None
+		};
+		match patch {
+			Some((keep, patch)) => Some((slot, keep, patch.frames(caps.words_per_frame()).len(), frames)),
+			None => Some((slot, 0, frames, frames)),
+		}
+	}
+
+	// What device holds in slot after a successful bootload
+	pub fn record(&mut self, device: u32, caps: u32, slot: u16, held: Slot) {
+		let entry = self.devices.entry(device).or_insert_with(Device::default);
+		entry.caps = caps;
+		entry.slots[slot as usize] = Some(held);
+		entry.active = Some(slot);
+	}
+
+	// Drop a record the device did not confirm
+	pub fn forget(&mut self, device: u32, slot: u16) {
+		if let Some(entry) = self.devices.get_mut(&device) {
+			entry.slots[slot as usize] = None;
+		}
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use super::*;
+	use std::env;
+	use std::fs;
+	use std::process;
+
+	#[test]
+	fn save_and_load_round_trip() {
+		let path = env::temp_dir().join(format!("inventory-test-{}", process::id()));
+		let path = path.to_str().unwrap();
+		let mut inventory = Inventory::load(path).unwrap();
+		assert!(inventory.device(487).is_none());
+		inventory.record(487, 0xCA0B3F3F, 1, Slot { crc: 0xA250, length: 0x3FF0, sectors: vec![(0x08, 0x1B2E), (0x04, 0x93C0)] });
+		inventory.record(487, 0xCA0B3F3F, 0, Slot { crc: 0x1234, length: 0x10, sectors: Vec::new() });
+		inventory.record(12, 0, 1, Slot { crc: 0x0001, length: 0x2, sectors: vec![(0x40, 0xFFFF)] });
+		inventory.save().unwrap();
+
+		let loaded = Inventory::load(path).unwrap();
+		fs::remove_file(path).unwrap();
+		let device = loaded.device(487).unwrap();
+		assert_eq!(device.caps, 0xCA0B3F3F);
+		assert_eq!(device.active, Some(0));
+		let held = device.slots[1].as_ref().unwrap();
+		assert_eq!((held.crc, held.length), (0xA250, 0x3FF0));
+		assert_eq!(held.sectors, vec![(0x08, 0x1B2E), (0x04, 0x93C0)]);
+		assert!(device.slots[0].as_ref().unwrap().sectors.is_empty());
+		assert_eq!(loaded.device(12).unwrap().active, Some(1));
+	}
+
+	#[test]
+	fn bad_lines_are_rejected() {
+		let mut inventory = Inventory { path: String::new(), devices: BTreeMap::new() };
+		assert!(inventory.parse("487 1 a250 3ff0 ca063f3f C:1b2e,D:93c0"));
+		assert!(!inventory.parse("487 2 a250 3ff0 ca063f3f"));
+		assert!(!inventory.parse("487 1 a250 3ff0"));
+		assert!(!inventory.parse("487 1 a250 3ff0 ca063f3f J:1b2e"));
+		assert!(!inventory.parse("487 1 xyz 3ff0 ca063f3f"));
+	}
+}
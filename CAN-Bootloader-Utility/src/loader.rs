@@ -0,0 +1,65 @@
+// Reply and command handling shared by the bootload steps
+use canlib;
+use bus::Bus;
+use protocol::*;
+
+const REPLY_TIMEOUT: u32 = 100;
+
+pub fn set_profile(bus: &mut dyn Bus, profile: u8) -> i16 {
+	let (freq, tseg1, tseg2, sjw) = bus_params(profile);
+	bus.set_params(freq, tseg1, tseg2, sjw)
+}
+
+// Wait for the next reply frame, hellos included, counting error frames
+// seen on the way
+pub fn read_reply(bus: &mut dyn Bus, timeout: u32, errors: &mut u32) -> Option<Reply> {
+	loop {
+		match bus.read(timeout) {
+			Ok(frame) => {
+				if frame.flags & (canlib::MSG_ERROR_FRAME | canlib::MSGERR_MASK) != 0 {
+					*errors += 1;
+				}
+				else if frame.id == REPLY_ID as i32 || frame.id == HELLO_ID as i32 {
+					return Some(Reply::parse(&frame.data));
+				}
+			}
+			Err(_) => return None,
+		}
+	}
+}
+
+pub fn wait_heartbeat(bus: &mut dyn Bus, timeout: u32) -> bool {
+	let mut errors = 0;
+	loop {
+		match read_reply(bus, timeout, &mut errors) {
+			Some(reply) => if reply.status == STATUS_HEARTBEAT { return true },
+			None => return false,
+		}
+	}
+}
+
+pub fn command(bus: &mut dyn Bus, command: u8, argument: u8, errors: &mut u32) -> Option<Reply> {
+	ask(bus, command, &command_frame(command, argument), REPLY_TIMEOUT, errors)
+}
+
+// Command that carries data in MDH
+pub fn command_data(bus: &mut dyn Bus, command: u8, argument: u8, data: u32, errors: &mut u32) -> Option<Reply> {
+	ask(bus, command, &command_data_frame(command, argument, data), REPLY_TIMEOUT, errors)
+}
+
+// Command the loader takes up to timeout ms to answer
+pub fn slow_command(bus: &mut dyn Bus, command: u8, argument: u8, timeout: u32, errors: &mut u32) -> Option<Reply> {
+	ask(bus, command, &command_frame(command, argument), timeout, errors)
+}
+
+fn ask(bus: &mut dyn Bus, command: u8, frame: &[u8], timeout: u32, errors: &mut u32) -> Option<Reply> {
+	if bus.write(DATA_ID, frame) != canlib::ERROR_OK {
+		return None;
+	}
+	loop {
+		match read_reply(bus, timeout, errors) {
+			Some(reply) => if reply.status != STATUS_HEARTBEAT && reply.arg == command as u16 { return Some(reply) },
+			None => return None,
+		}
+	}
+}
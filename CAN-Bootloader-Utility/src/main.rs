@@ -1,48 +1,70 @@
 extern crate libc;
-use libc::*;
-use std::io::prelude::*;
-use std::fs::File;
-use std::io::BufReader;
-use std::io::SeekFrom;
 use std::env;
+use std::sync::Arc;
 
-const NO_TIMEOUT: u32 = 0xFFFFFFFF;
-const ERROR_OK: i16 = 0;
-const BOOTLOAD_HEARTBEAT_ID: u16 = 0x2;
-const BOOTLOAD_BITRATE: i32 = -1;
-
-#[link(name = "canlib32")]
-extern {
-	fn canOpenChannel(ctrl: u16, flags: u16) -> i16;
-	fn canInitializeLibrary();
-	fn canSetBusParams(handle: i16, bitrate: i32, tseg1: u16, tseg2: u16, sjw: u16, noSamp: u16, syncmode: u16) -> i16;
-	fn canWriteWait(handle: i16, id: u32, msg: *const c_void, dlc: u16, flag: u16, timeout: u32) -> i16;
-	fn canBusOn(handle: i16) -> i16;
-	fn canClose(handle: i16) -> i16;
-	//fn canReadWait(handle: i16, id: *mut i32, msg: *mut c_void, dlc: *mut u16, flag: *mut u16, time: *mut u32, timeout: u32) -> i16;
-	fn canFlushReceiveQueue(handle: i16) -> i16;
-	fn canReadSyncSpecific(handle: i16, id: u16, timeout: u32) -> i16;
-	fn canReadSpecificSkip(handle: i16, id: i32, msg: *mut c_void, dlc: *mut u16, flag: *mut u16, time: *mut u32) -> i16;
-	//fn canReadWait(handle: i16, id: *mut i32, msg: *mut c_void, dlc: *mut u16, flag: *mut u16, time: *mut u32, timeout: u32) -> i16;
+// Progress text for people. It goes to stderr when -json owns stdout.
+macro_rules! note {
+	($($arg:tt)*) => (
+		if ::events::enabled() { eprintln!($($arg)*) }
+		else if !::events::silent() { println!($($arg)*) }
+	)
 }
 
+mod events;
+mod canlib;
+mod bus;
+mod budget;
+mod protocol;
+mod loader;
+mod autobaud;
+mod frames;
+mod pacing;
+mod image;
+mod session;
+mod fleet;
+mod inventory;
+mod dump;
+mod sim;
+mod bench;
+use std::sync::Mutex;
+use canlib::*;
+use image::Image;
+use inventory::Inventory;
+use session::Options;
+
 fn main() {
     // CAN library initialization
-	let mut file_param = String::from("");
-	let mut device_param = 0;
+	let mut file_params: Vec<String> = Vec::new();
+	let mut devices: Vec<u32> = Vec::new();
 	let mut bypass_cmd_start = 0;
-	let mut bus = 0;
+	let mut buses: Vec<u16> = Vec::new();
 	let mut bitrate = 0;
-	
+	let mut boot_profile = protocol::PROFILE_DEFAULT;
+	let mut autobaud = false;
+	let mut max_retries = 0;
+	let mut window = session::DEFAULT_WINDOW;
+	let mut ram = false;
+	let mut base_params: Vec<String> = Vec::new();
+	let mut inventory_file: Option<String> = None;
+	let mut dump: Option<String> = None;
+	let mut budget: Option<f64> = None;
+	let mut ids: Option<(u32, u16)> = None;
+	let mut selftest = false;
+	let mut bench_file: Option<String> = None;
+	let mut recovery_file: Option<String> = None;
+	let mut faults: Option<String> = None;
+
 	// Determine arguments
 	let args: Vec<_> = env::args().collect();
 	for index in 0..args.len() {
 		if (args[index] == "-i") && (index + 1 < args.len()){
-			file_param = args[index + 1].to_string();
+			// May be given once per slot build of the program
+			file_params.push(args[index + 1].to_string());
 		}
 		else if (args[index] == "-d") && (index + 1 < args.len()) {
+			// May be given once per device to flash
 			match args[index + 1].parse::<u32>() {
-				Ok(n) => device_param = n,
+				Ok(n) => devices.push(n),
 				Err(e) => {
 					println!("Unable to parse -d. Error: {}", e);
 					return
@@ -53,8 +75,9 @@ fn main() {
 			bypass_cmd_start = 1;
 		}
 		else if args[index] == "-bus" {
+			// May be given once per channel to flash over
 			match args[index + 1].parse::<u16>() {
-				Ok(n) => bus = n,
+				Ok(n) => buses.push(n),
 				Err(e) => {
 					println!("Unable to parse -bus. Error: {}", e);
 					return
@@ -76,155 +99,250 @@ fn main() {
 				}
 			}
 		}
-	}
-	
-	println!("File: {}, Dev: {}", file_param, device_param);
-	
-	unsafe {canInitializeLibrary()};
-	
-	let hndl = unsafe {canOpenChannel(bus, 0)};
-	
-	if hndl < ERROR_OK {
-		println!("Failed to open CAN channel!. Error: {}", hndl);
-		return
-	}
-	
-	let mut result = unsafe {canSetBusParams(hndl, bitrate, 0, 0, 0, 0, 0)};
-	
-	if result != ERROR_OK {
-		println!("Failed to set CAN bus parameters. Error: {}", result);
-		return
-	}
-	
-	result = unsafe {canBusOn(hndl)};
-	if result != ERROR_OK {
-		println!("Failed to go bus on. Error: {}", result);
-		return
-	}
-	
-	
-	// Attempt to read program hex file
-	let f =  match File::open(file_param) {
-		Ok(f) => f,
-		Err(e) => {
-			println!("Unable to open program file. Error: {}", e);
-			return
+		else if (args[index] == "-bootprofile") && (index + 1 < args.len()) {
+			match args[index + 1].parse::<u8>() {
+				Ok(n) if n <= protocol::PROFILE_MAX => boot_profile = n,
+				_ => {
+					println!("-bootprofile must be 0 to {}", protocol::PROFILE_MAX);
+					return
+				}
+			}
 		}
-	};
-	let mut complete = 0;
-	
-	if (device_param != 0) && (bypass_cmd_start == 0)
-	{
-		let mut bootload_start_cmd: [u8; 8] = [0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF];
-		let result = unsafe {canWriteWait(hndl, device_param, bootload_start_cmd.as_mut_ptr() as *mut c_void, 8, 0, 10000)};
-		if result != 0 {
-			println!("Unable to send start CAN bootload message. Error: {}", result);
-			return
+		else if (args[index] == "-base") && (index + 1 < args.len()) {
+			// May be given once per slot, like -i
+			base_params.push(args[index + 1].to_string());
+		}
+		else if (args[index] == "-inventory") && (index + 1 < args.len()) {
+			inventory_file = Some(args[index + 1].to_string());
+		}
+		else if (args[index] == "-dump") && (index + 1 < args.len()) {
+			dump = Some(args[index + 1].to_string());
+		}
+		else if (args[index] == "-budget") && (index + 1 < args.len()) {
+			// Percent of bus time
+			match args[index + 1].parse::<u32>() {
+				Ok(n) if n > 0 && n <= 100 => budget = Some(n as f64 / 100.0),
+				_ => {
+					println!("-budget must be 1 to 100");
+					return
+				}
+			}
+		}
+		else if (args[index] == "-ids") && (index + 1 < args.len()) {
+			// Data and reply ID, -ids 0x700,0x701
+			let parsed: Vec<Option<u32>> = args[index + 1].split(',').map(parse_id).collect();
+			match parsed.as_slice() {
+				&[Some(data_id), Some(reply_id)] if data_id != reply_id => ids = Some((data_id, reply_id as u16)),
+				_ => {
+					println!("-ids must be two different standard IDs, data then reply");
+					return
+				}
+			}
+		}
+		else if args[index] == "-ram" {
+			ram = true;
+		}
+		else if args[index] == "-selftest" {
+			selftest = true;
+		}
+		else if args[index] == "-autobaud" {
+			autobaud = true;
+		}
+		else if (args[index] == "-bench") && (index + 1 < args.len()) {
+			bench_file = Some(args[index + 1].to_string());
+		}
+		else if (args[index] == "-recovery") && (index + 1 < args.len()) {
+			recovery_file = Some(args[index + 1].to_string());
+		}
+		else if (args[index] == "-faults") && (index + 1 < args.len()) {
+			faults = Some(args[index + 1].to_string());
+		}
+		else if args[index] == "-json" {
+			events::enable();
+		}
+		else if (args[index] == "-window") && (index + 1 < args.len()) {
+			match args[index + 1].parse::<usize>() {
+				Ok(n) => window = n,
+				Err(e) => {
+					println!("Unable to parse -window. Error: {}", e);
+					return
+				}
+			}
+		}
+		else if (args[index] == "-retries") && (index + 1 < args.len()) {
+			match args[index + 1].parse::<u32>() {
+				Ok(n) => max_retries = n,
+				Err(e) => {
+					println!("Unable to parse -retries. Error: {}", e);
+					return
+				}
+			}
 		}
 	}
-	else if bypass_cmd_start == 0
-	{
-		println!("Device param -d can not be 0. Quitting!");
+
+	// The benchmarks need no hardware and no program file
+	if let Some(path) = bench_file {
+		match bench::run(&path) {
+			Ok(()) => println!("Benchmark results written to {}", path),
+			Err(e) => {
+				println!("{}", e);
+				::std::process::exit(1);
+			}
+		}
 		return
 	}
-	else
-	{
-		println!("Bootload start command bypassed!");
-	}
-	
-	// Flush queue to be safe
-	unsafe{canFlushReceiveQueue(hndl)};
-	
-	// Change bitrate to bootloading bitrate (1 Mb/sec)
-	unsafe{canSetBusParams(hndl, BOOTLOAD_BITRATE, 0, 0, 0, 0, 0)};
-	
-	if result != ERROR_OK {
-		println!("Failed to set CAN bus parameters. Error: {}", result);
+	if let Some(path) = recovery_file {
+		match bench::recovery(&path, faults.as_ref().map(|f| f.as_str())) {
+			Ok(()) => println!("Recovery results written to {}", path),
+			Err(e) => {
+				println!("{}", e);
+				::std::process::exit(1);
+			}
+		}
 		return
 	}
-	
-	while complete == 0 {
 
-		// Wait for message that device bootload is ready for program
-		let mut rx_bytes: [u8; 8] = [0, 0, 0, 0, 0, 0, 0, 0];
-		let mut dlc = 0;
-		let mut flag = 0;
-		let mut time = 0;
-		let mut start = 0;
-		while start == 0 {
-			result = unsafe{canReadSyncSpecific(hndl, BOOTLOAD_HEARTBEAT_ID, NO_TIMEOUT)};
-			if result == 0{
-				start = 1;
-			}
-		}
-		println!("Found bootload heartbeat! Started bootload!\n");
-		unsafe{canFlushReceiveQueue(hndl)};
+	let device_list: Vec<String> = devices.iter().map(|d| d.to_string()).collect();
+	note!("File: {}, Dev: {}", file_params.join(", "), device_list.join(", "));
 
-		// Start sending program to bootloader
-		let mut file_contents = BufReader::new(&f);
-		match file_contents.seek(SeekFrom::Start(0)) {
-				Ok(n) => {}
-				Err(e) => {
-					println!("Unable to reset. Error: {}", e);
-					return
+	// Decode the program files up front. Every channel sends from these.
+	let mut images: Vec<Image> = Vec::new();
+	for file_param in &file_params {
+		match Image::load(file_param) {
+			Ok(image) => {
+				match image.slot() {
+					Some(slot) => note!("{} is linked for slot {}, entry point {:#x}", file_param, slot, image.entry),
+					None if image.in_ram() => note!("{} is linked for RAM, entry point {:#x}", file_param, image.entry),
+					None => note!("{} does not fit in a single application slot", file_param),
 				}
-		}
-		let mut bytes: [u8; 4] = [0, 0, 0, 0];
-		let mut index = 0;
-		let mut count: u16 = 0;
-
-		for byte in file_contents.bytes() {
-			let content = byte.unwrap();
-			if content >= 48		// If not STX or ETX
-			{
-				bytes[index] = convert_ascii_to_hex(content);
-				index += 1;
-				if index >= 4 {
-					index = 0;
-					count = count + 1;
-					can_send_stream(hndl, (bytes[0] << 4) + bytes[1], (bytes[2] << 4) + bytes[3], count);
+				if image.sections != image.blocks.len() {
+					note!("{}: {} sections sent as {} blocks in address order", file_param, image.sections, image.blocks.len());
 				}
+				images.push(image);
+			}
+			Err(e) => {
+				note!("{}", e);
+				return
 			}
 		}
+	}
+	if images.is_empty() {
+		note!("No program file given with -i. Quitting!");
+		return
+	}
+	let mut base = Vec::new();
+	for base_param in &base_params {
+		match Image::load(base_param) {
+			Ok(image) => base.push(image),
+			Err(e) => {
+				note!("{}", e);
+				return
+			}
+		}
+	}
 
-		result = unsafe{canReadSyncSpecific(hndl, 2, 10000)};
-		if result == ERROR_OK
-		{
-			result = unsafe{canReadSpecificSkip(hndl, 2, rx_bytes.as_mut_ptr() as *mut c_void, &mut dlc, &mut flag, &mut time)};
-			// Successful program message received. Bootloading complete
-			if (result == ERROR_OK) && (rx_bytes[2] == 128){
-				complete = 1;
-				println!("Bootloading completed successfully!");
+	// Work out from the inventory what each device needs before starting
+	let mut inventory = None;
+	if let Some(path) = inventory_file {
+		match Inventory::load(&path) {
+			Ok(loaded) => inventory = Some(loaded),
+			Err(e) => {
+				note!("{}", e);
+				return
+			}
+		}
+	}
+	if let Some(ref inventory) = inventory {
+		for &device in &devices {
+			match inventory.plan(device, &images) {
+				Some((slot, 0, frames, _)) => note!("Device {}: slot {}, {} frames", device, slot, frames),
+				Some((slot, keep, frames, total)) if window != 0 => note!("Device {}: slot {}, sectors {} already hold the image, {} of {} frames",
+					device, slot, protocol::sector_names(keep), frames, total),
+				Some((slot, _, _, total)) => note!("Device {}: slot {}, {} frames", device, slot, total),
+				None => note!("Device {}: not in the inventory", device),
 			}
 		}
-		if complete != 1 {
-			println!("Bootloading failed! Waiting for bootload heartbeat for retry ...");
+	}
+
+	if bypass_cmd_start != 0 {
+		// The device is already waiting in its loader
+		note!("Bootload start command bypassed!");
+		if devices.is_empty() {
+			devices.push(0);
 		}
 	}
-	result = unsafe {canClose(hndl)};
-		if result != ERROR_OK {
-		println!("Failed to close bus. Error: {}", result);
+	else if devices.is_empty() || devices.contains(&0) {
+		note!("Device param -d can not be 0. Quitting!");
 		return
 	}
-	
-}
+	if buses.is_empty() {
+		buses.push(0);
+	}
+
+	unsafe {canInitializeLibrary()};
 
-fn convert_ascii_to_hex(ascii_char: u8) -> u8
-{
-	if ascii_char > 64 {
-		return ascii_char - 55
+	let options = Options {
+		bitrate: bitrate,
+		bypass: bypass_cmd_start != 0,
+		boot_profile: boot_profile,
+		autobaud: autobaud,
+		max_retries: max_retries,
+		window: window,
+		ram: ram,
+		base: base,
+		inventory: inventory.map(Mutex::new),
+		dump: dump,
+		budget: budget,
+		ids: ids,
+		selftest: selftest,
+	};
+	let options = Arc::new(options);
+	let reports = fleet::run(&buses, devices.clone(), Arc::new(images), options.clone());
+	if let Some(ref inventory) = options.inventory {
+		if let Err(e) = inventory.lock().unwrap().save() {
+			note!("{}", e);
+		}
 	}
-	else {
-		return ascii_char - 48
+
+	let mut attempted = 0;
+	let mut channels = Vec::new();
+	for report in &reports {
+		note!("Bus {}: {} flashed, {} failed, {} frames at {:.0} frames/s, {} retries, {:.1} s",
+			report.bus, report.flashed.len(), report.failed.len(), report.stats.frames,
+			report.frames_per_second(), report.stats.retries, report.seconds());
+		for &(device, ref e) in &report.failed {
+			note!("  Device {} failed: {}", device, e);
+		}
+		attempted += report.flashed.len() + report.failed.len();
+		channels.push(events::Record::object()
+			.num("bus", report.bus)
+			.num("flashed", report.flashed.len())
+			.num("failed", report.failed.len())
+			.num("frames", report.stats.frames)
+			.num("bytes", report.stats.bytes)
+			.float("frames_per_s", report.frames_per_second())
+			.num("retries", report.stats.retries)
+			.num("retransmits", report.stats.retransmits)
+			.num("backoffs", report.stats.backoffs)
+			.num("elapsed_ms", events::millis(report.elapsed)));
 	}
+	if attempted < devices.len() {
+		note!("{} devices were not attempted, no channel could be opened", devices.len() - attempted);
+	}
+	events::Record::new("summary")
+		.num("devices", devices.len())
+		.num("flashed", reports.iter().map(|r| r.flashed.len()).sum::<usize>())
+		.num("failed", reports.iter().map(|r| r.failed.len()).sum::<usize>())
+		.num("not_attempted", devices.len() - attempted)
+		.list("channels", channels)
+		.emit();
 }
 
-fn can_send_stream(handle: i16, byte1: u8, byte2: u8, count: u16)
-{
-	let mut msg_data: [u8; 4] = [(count >> 8) as u8, count as u8, byte1, byte2];
-	let mut result = unsafe {canWriteWait(handle, 1, msg_data.as_mut_ptr() as *mut c_void, 4, 0, 10000)};
-	while result != 0 {
-		println!("Failed to send CAN message: {}, {}", byte1, byte2);
-		result = unsafe {canWriteWait(handle, 1, msg_data.as_mut_ptr() as *mut c_void, 4, 0, 10000)};
+// Standard CAN ID, in hex with 0x in front
+fn parse_id(text: &str) -> Option<u32> {
+	let parsed = if text.starts_with("0x") { u32::from_str_radix(&text[2..], 16) } else { text.parse::<u32>() };
+	match parsed {
+		Ok(id) if id <= 0x7FF => Some(id),
+		_ => None,
 	}
-}
\ No newline at end of file
+}
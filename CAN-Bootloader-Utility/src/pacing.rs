@@ -0,0 +1,109 @@
+// Send pacing for a windowed stream. Version 8 loaders report with every
+// ack and NACK the frames they lost since the last report and the larger of
+// their CAN error counters, see CAN_RxHealth(). Older ones report 0.
+//
+// A report of lost frames halves the window down to the ack interval, below
+// which the loader would not ack at all, and past that doubles the gap
+// between frames. Bus errors do not come from our rate, and waiting does
+// not clear them, so an error counter at the warning level only halves the
+// window, which keeps fewer frames exposed, and holds it there. Clean
+// reports close the gap a step at a time, then grow the window a frame at a
+// time up to the loader's receive ring. The stream settles just below the
+// rate at which the loader starts to drop frames.
+use std::cmp::{max, min};
+
+// eCAN error warning level, CANES.EW
+const WARNING_LEVEL: u16 = 96;
+const GAP_STEP_US: u32 = 50;
+const MAX_GAP_US: u32 = 5000;
+
+pub struct Pacer {
+	pub window: usize,		// Frames in flight
+	pub gap_us: u32,		// Wait after each frame
+	pub backoffs: u32,
+	floor: usize,
+	ceiling: usize,
+}
+
+impl Pacer {
+	// Start at window, which the loader acks every floor frames
+	pub fn new(window: usize, floor: usize, ceiling: usize) -> Pacer {
+		Pacer { window: window, gap_us: 0, backoffs: 0, floor: floor, ceiling: max(ceiling, window) }
+	}
+
+	// Take the MDL high word of a WINDOW or NACK reply
+	pub fn report(&mut self, health: u16) {
+		let lost = health >> 8;
+		let errors = health & 0xFF;
+		if lost != 0 {
+			self.backoffs += 1;
+			if self.window > self.floor {
+				self.window = max(self.window / 2, self.floor);
+			}
+			else {
+				self.gap_us = min(max(self.gap_us * 2, GAP_STEP_US), MAX_GAP_US);
+			}
+		}
+		else if errors >= WARNING_LEVEL {
+			if self.window > self.floor {
+				self.backoffs += 1;
+				self.window = max(self.window / 2, self.floor);
+			}
+		}
+		else if self.gap_us != 0 {
+			self.gap_us = self.gap_us.saturating_sub(GAP_STEP_US);
+		}
+		else if self.window < self.ceiling {
+			self.window += 1;
+		}
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use super::*;
+
+	const LOST: u16 = 1 << 8;
+
+	#[test]
+	fn lost_frames_halve_the_window_then_widen_the_gap() {
+		let mut pacer = Pacer::new(32, 16, 63);
+		pacer.report(LOST);
+		assert_eq!((pacer.window, pacer.gap_us), (16, 0));
+		pacer.report(LOST);
+		assert_eq!((pacer.window, pacer.gap_us), (16, GAP_STEP_US));
+		pacer.report(LOST);
+		assert_eq!(pacer.gap_us, 2 * GAP_STEP_US);
+		assert_eq!(pacer.backoffs, 3);
+		for _ in 0..20 {
+			pacer.report(LOST);
+		}
+		assert_eq!(pacer.gap_us, MAX_GAP_US);
+	}
+
+	#[test]
+	fn clean_reports_close_the_gap_before_growing_the_window() {
+		let mut pacer = Pacer::new(16, 16, 20);
+		pacer.report(LOST);
+		pacer.report(LOST);
+		assert_eq!(pacer.gap_us, 2 * GAP_STEP_US);
+		pacer.report(0);
+		pacer.report(0);
+		assert_eq!((pacer.window, pacer.gap_us), (16, 0));
+		for _ in 0..10 {
+			pacer.report(0);
+		}
+		assert_eq!(pacer.window, 20);
+	}
+
+	#[test]
+	fn bus_errors_only_halve_the_window() {
+		let mut pacer = Pacer::new(32, 16, 63);
+		pacer.report(WARNING_LEVEL);
+		pacer.report(WARNING_LEVEL);
+		assert_eq!((pacer.window, pacer.gap_us, pacer.backoffs), (16, 0, 1));
+		// Held while the errors last
+		pacer.report(WARNING_LEVEL);
+		assert_eq!(pacer.window, 16);
+	}
+}
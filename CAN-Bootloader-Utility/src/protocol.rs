@@ -0,0 +1,208 @@
+// Frame layout and codes shared with CAN_Boot.c
+
+pub const DATA_ID: u32 = 0x1;
+pub const REPLY_ID: u16 = 0x2;
+// Version 4 loaders send STATUS_HELLO here, see BOOT_HELLO_ID. Hosts that
+// take any frame on REPLY_ID as the heartbeat then wait for the real one.
+pub const HELLO_ID: u16 = 0x3;
+
+// Last byte of the start command for a RAM load instead of 0xFF, see
+// BOOT_START_RAM in BootHandoff.h
+pub const START_RAM: u8 = 0x5A;
+// Heartbeat slot of a loader waiting for a RAM image, see BOOT_SLOT_RAM
+pub const SLOT_RAM: u16 = 2;
+
+// Reply status codes, see BOOT_STATUS_x
+pub const STATUS_HEARTBEAT: u16 = 0x0000;
+pub const STATUS_ACK: u16 = 0x0001;
+pub const STATUS_WINDOW: u16 = 0x0002;
+pub const STATUS_NACK: u16 = 0x0003;
+pub const STATUS_HELLO: u16 = 0x0004;
+pub const STATUS_SUCCESS: u16 = 0x8000;
+pub const STATUS_FAIL_CRC: u16 = 0xFFF9;
+
+// Commands accepted before the boot stream starts, see BOOT_CMD_x
+pub const CMD_PING: u8 = 0x01;
+pub const CMD_SET_PROFILE: u8 = 0x02;
+pub const CMD_SLOT_INFO: u8 = 0x03;
+pub const CMD_WINDOW: u8 = 0x04;
+pub const CMD_KEEP: u8 = 0x05;
+pub const CMD_SLOT_CRC: u8 = 0x06;
+pub const CMD_READ: u8 = 0x07;
+pub const CMD_SET_IDS: u8 = 0x08;
+pub const CMD_SELF_TEST: u8 = 0x09;
+pub const CMD_EXPECT_CRC: u8 = 0x0A;
+
+// SYSCLKOUT the loader is built for, see CPU_RATE
+pub const CPU_HZ: u64 = 60000000;
+
+// Loader capabilities sent in every heartbeat, see BOOT_CAPS
+const CAPS_MAGIC: u8 = 0xCA;
+pub const MODE_COMMANDS: u8 = 0x01;
+pub const MODE_MULTIWORD: u8 = 0x02;
+pub const MODE_CRC: u8 = 0x04;
+pub const MODE_WINDOW: u8 = 0x08;
+pub const MODE_POSITION: u8 = 0x10;
+pub const MODE_KEEP: u8 = 0x20;
+pub const MODE_SLOT_CRC: u8 = 0x40;
+pub const MODE_READ: u8 = 0x80;
+
+// Flash sectors on the F28035 are 8K words
+const SECTOR_SIZE: u32 = 0x2000;
+
+// Bit timing profiles, see BOOT_PROFILE_x in BootHandoff.h. Bits 1:0 select
+// the bit rate, bit 2 the 87% sample point.
+pub const PROFILE_DEFAULT: u8 = 0;
+pub const PROFILE_MAX: u8 = 7;
+const PROFILE_SP87: u8 = 4;
+
+// Every profile, fastest bit rate first
+pub const PROFILE_ORDER: [u8; 8] = [0, 4, 1, 5, 2, 6, 3, 7];
+
+// Reply frame from the loader. MDL is sent first, most significant byte first.
+pub struct Reply {
+	pub arg: u16,		// Slot for heartbeats, command for command replies
+	pub status: u16,
+	pub data: u32,
+}
+
+impl Reply {
+	pub fn parse(bytes: &[u8; 8]) -> Reply {
+		Reply {
+			arg: ((bytes[0] as u16) << 8) | bytes[1] as u16,
+			status: ((bytes[2] as u16) << 8) | bytes[3] as u16,
+			data: ((bytes[4] as u32) << 24) | ((bytes[5] as u32) << 16) | ((bytes[6] as u32) << 8) | bytes[7] as u32,
+		}
+	}
+}
+
+pub struct Caps {
+	pub version: u8,	// 0 for loaders without the capability handshake
+	pub modes: u8,
+	pub ring_frames: u8,
+}
+
+impl Caps {
+	pub fn from_heartbeat(heartbeat: &Reply) -> Caps {
+		Caps::from_word(heartbeat.data)
+	}
+
+	// BOOT_CAPS as sent in the heartbeat MDH
+	pub fn from_word(caps: u32) -> Caps {
+		if (caps >> 24) as u8 != CAPS_MAGIC {
+			return Caps { version: 0, modes: 0, ring_frames: 1 };
+		}
+		Caps {
+			version: (caps >> 16) as u8,
+			modes: (caps >> 8) as u8,
+			ring_frames: caps as u8,
+		}
+	}
+
+	pub fn supports(&self, mode: u8) -> bool {
+		self.modes & mode != 0
+	}
+
+	// Most boot stream words the loader takes in one frame
+	pub fn words_per_frame(&self) -> usize {
+		if self.supports(MODE_MULTIWORD) { 3 } else { 1 }
+	}
+}
+
+// Flash API SECTORx mask as sector letters, "C,D" for SECTORC|SECTORD
+pub fn sector_names(mask: u16) -> String {
+	let names: Vec<String> = (0..8).filter(|bit| mask & (1 << bit) != 0)
+		.map(|bit| ((b'A' + bit as u8) as char).to_string())
+		.collect();
+	names.join(",")
+}
+
+// SLOT_CRC answer for a slot holding an image with this CRC16 and length
+pub fn slot_crc(crc: u16, length: u32) -> u32 {
+	((crc as u32) << 16) | (length & 0xFFFF)
+}
+
+// First and last address of a slot, from a SLOT_INFO reply
+pub fn slot_range(reply: &Reply) -> (u32, u32) {
+	let start = reply.data & 0x3FFFFF;
+	let sectors = (reply.data >> 24).count_ones();
+	(start, start + sectors * SECTOR_SIZE - 1)
+}
+
+pub fn command_frame(command: u8, argument: u8) -> [u8; 4] {
+	[0, 0, command, argument]
+}
+
+// Command with data in MDH
+pub fn command_data_frame(command: u8, argument: u8, data: u32) -> [u8; 8] {
+	[0, 0, command, argument, (data >> 24) as u8, (data >> 16) as u8, (data >> 8) as u8, data as u8]
+}
+
+// READ of frames * 4 words from addr, which goes in MDH
+pub fn read_frame(addr: u32, frames: u8) -> [u8; 8] {
+	command_data_frame(CMD_READ, frames, addr)
+}
+
+// canSetBusParams() frequency, tseg1, tseg2 and sjw matching the loader's
+// CAN_BTC(profile): 15 time quanta per bit, SJW of 2
+pub fn bus_params(profile: u8) -> (i32, u32, u32, u32) {
+	let freq = 1000000 >> (profile & 3);
+	if profile & PROFILE_SP87 != 0 {
+		(freq, 12, 2, 2)
+	}
+	else {
+		(freq, 11, 3, 2)
+	}
+}
+
+pub fn profile_name(profile: u8) -> String {
+	let (freq, tseg1, _, _) = bus_params(profile);
+	format!("{} kbit/s, sample point {}%", freq / 1000, (1 + tseg1) * 100 / 15)
+}
+
+#[cfg(test)]
+mod tests {
+	use super::*;
+
+	#[test]
+	fn reply_is_mdl_then_mdh_most_significant_byte_first() {
+		let reply = Reply::parse(&[0x00, 0x03, 0x00, 0x01, 0xE0, 0x3E, 0x80, 0x00]);
+		assert_eq!(reply.arg, CMD_SLOT_INFO as u16);
+		assert_eq!(reply.status, STATUS_ACK);
+		assert_eq!(reply.data, 0xE03E8000);
+	}
+
+	#[test]
+	fn caps_from_heartbeat() {
+		let heartbeat = Reply::parse(&[0, 1, 0, 0, 0xCA, 0x01, 0x07, 0x3F]);
+		let caps = Caps::from_heartbeat(&heartbeat);
+		assert_eq!((caps.version, caps.modes, caps.ring_frames), (1, 0x07, 63));
+		assert!(caps.supports(MODE_CRC));
+		assert_eq!(caps.words_per_frame(), 3);
+	}
+
+	#[test]
+	fn caps_without_magic_are_the_original_protocol() {
+		let heartbeat = Reply::parse(&[0, 1, 0, 0, 0x01, 0x07, 0xFF, 0x3F]);
+		let caps = Caps::from_heartbeat(&heartbeat);
+		assert_eq!((caps.version, caps.modes, caps.ring_frames), (0, 0, 1));
+		assert_eq!(caps.words_per_frame(), 1);
+	}
+
+	#[test]
+	fn slot_range_from_slot_info() {
+		// Sectors H, G and F from 0x3E8000
+		let reply = Reply { arg: CMD_SLOT_INFO as u16, status: STATUS_ACK, data: 0xE03E8000 };
+		assert_eq!(slot_range(&reply), (0x3E8000, 0x3EDFFF));
+	}
+
+	#[test]
+	fn frames_and_names() {
+		assert_eq!(command_frame(CMD_WINDOW, 16), [0, 0, 4, 16]);
+		assert_eq!(read_frame(0x3EE000, 2), [0, 0, CMD_READ, 2, 0x00, 0x3E, 0xE0, 0x00]);
+		assert_eq!(sector_names(0x0C), "C,D");
+		assert_eq!(slot_crc(0xA250, 0x13FF0), 0xA2503FF0);
+		assert_eq!(bus_params(2), (250000, 11, 3, 2));
+		assert_eq!(bus_params(4), (1000000, 12, 2, 2));
+	}
+}
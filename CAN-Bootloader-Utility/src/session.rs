@@ -0,0 +1,645 @@
+// One bootload of one device over an open channel
+use canlib::NO_TIMEOUT;
+use bus;
+use bus::Bus;
+use budget::Scheduler;
+use protocol;
+use loader;
+use autobaud;
+use dump;
+use image;
+use image::Image;
+use frames::FrameRing;
+use pacing::Pacer;
+use inventory;
+use inventory::Inventory;
+use events;
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+// Wait for the result once the whole stream is sent
+const REPLY_TIMEOUT: u32 = 10000;
+// Frames between checks for a failure reply while sending
+const POLL_FRAMES: usize = 16;
+// Time between progress events with -json
+const PROGRESS_INTERVAL_MS: u64 = 250;
+// Batches of the loader's receive ring to loop through in -selftest, and
+// the time it may take at the slowest bit rate
+const SELF_TEST_BATCHES: u8 = 16;
+const SELF_TEST_TIMEOUT: u32 = 5000;
+// Frames in flight at the start of the stream when the loader takes a
+// window, see -window. The pacer moves it from there.
+pub const DEFAULT_WINDOW: usize = 32;
+
+// Settings shared by every channel
+pub struct Options {
+	pub bitrate: i32,		// canSetBusParams() constant for the start command
+	pub bypass: bool,
+	pub boot_profile: u8,
+	pub autobaud: bool,
+	pub max_retries: u32,	// 0 to retry until the bootload completes
+	pub window: usize,		// Frames first sent ahead of the loader's acks, 0 for none
+	pub ram: bool,			// Ask for a RAM load, see -ram
+	pub base: Vec<Image>,	// What the slots hold now, see -base
+	pub inventory: Option<Mutex<Inventory>>,	// See -inventory
+	pub dump: Option<String>,	// Backup file prefix, see -dump
+	pub budget: Option<f64>,	// Share of bus time, see -budget
+	pub ids: Option<(u32, u16)>,	// Data and reply IDs, see -ids
+	pub selftest: bool,		// See -selftest
+}
+
+// Totals for the bootloads run on one channel
+#[derive(Default)]
+pub struct Stats {
+	pub frames: u64,
+	pub bytes: u64,			// Data frame payload, sequence numbers included
+	pub retries: u32,
+	pub retransmits: u64,	// Frames sent again after canWriteWait failed or a NACK
+	pub backoffs: u64,		// Times the loader's reports slowed the stream, see pacing.rs
+}
+
+// Time spent in each step of one device's bootload, summed over its attempts
+#[derive(Default)]
+struct Phases {
+	heartbeat: Duration,
+	autobaud: Duration,
+	selftest: Duration,
+	slot: Duration,
+	dump: Duration,
+	send: Duration,
+	verify: Duration,
+}
+
+impl Phases {
+	fn record(&self) -> events::Record {
+		events::Record::object()
+			.num("heartbeat_ms", events::millis(self.heartbeat))
+			.num("autobaud_ms", events::millis(self.autobaud))
+			.num("selftest_ms", events::millis(self.selftest))
+			.num("slot_ms", events::millis(self.slot))
+			.num("dump_ms", events::millis(self.dump))
+			.num("send_ms", events::millis(self.send))
+			.num("verify_ms", events::millis(self.verify))
+	}
+}
+
+// Device being bootloaded, for progress text and events
+struct Target {
+	bus: u16,
+	device: u32,
+	tag: String,
+	attempt: u32,
+	blank: u16,			// Sectors the loader found blank and did not erase
+	kept: u16,			// Sectors programmed without erasing
+	dumped: bool,		// Running application saved, see -dump
+}
+
+impl Target {
+	fn event(&self, event: &str) -> events::Record {
+		events::Record::new(event).num("bus", self.bus).num("device", self.device).num("attempt", self.attempt)
+	}
+
+	// End the phase started at mark and start the next one
+	fn phase(&self, name: &str, mark: &mut Instant, total: &mut Duration) {
+		let now = Instant::now();
+		let elapsed = now - *mark;
+		*total += elapsed;
+		*mark = now;
+		self.event("phase").str("phase", name).num("ms", events::millis(elapsed)).emit();
+	}
+}
+
+// Start the loader on device and send it the image for the slot it asks
+// for. The channel is left at options.bitrate for the next device.
+pub fn bootload(channel: &mut dyn Bus, bus: u16, device: u32, images: &[Image], options: &Options, stats: &mut Stats) -> Result<(), String> {
+	let tag = format!("[bus {}, device {}]", bus, device);
+	let channel = &mut Scheduler::new(channel, options.budget, options.bitrate);
+
+	if !options.bypass {
+		let mut bootload_start_cmd: [u8; 8] = [0xFF; 8];
+		if options.ram {
+			bootload_start_cmd[7] = protocol::START_RAM;
+		}
+		let result = channel.write(device, &bootload_start_cmd);
+		if result != 0 {
+			return Err(format!("Unable to send start CAN bootload message. Error: {}", result));
+		}
+	}
+
+	// Flush queue to be safe
+	channel.flush();
+
+	// Change to the bit timing the loader starts in (1 Mb/sec unless the
+	// application hands over another profile)
+	let result = loader::set_profile(channel, options.boot_profile);
+	if result != 0 {
+		return Err(format!("Failed to set CAN bus parameters. Error: {}", result));
+	}
+
+	let start = Instant::now();
+	let (frames, bytes, retries, retransmits) = (stats.frames, stats.bytes, stats.retries, stats.retransmits);
+	let mut target = Target { bus: bus, device: device, tag: tag, attempt: 0, blank: 0, kept: 0, dumped: false };
+	let mut phases = Phases::default();
+	let outcome = run_attempts(channel, &mut target, images, options, stats, &mut phases);
+	channel.set_params(options.bitrate, 0, 0, 0);
+
+	let mut record = target.event("result").flag("ok", outcome.is_ok());
+	if let Err(ref e) = outcome {
+		record = record.str("error", e);
+	}
+	record.num("frames", stats.frames - frames)
+		.num("bytes", stats.bytes - bytes)
+		.num("retries", stats.retries - retries)
+		.num("retransmits", stats.retransmits - retransmits)
+		.str("blank_sectors", &protocol::sector_names(target.blank))
+		.str("kept_sectors", &protocol::sector_names(target.kept))
+		.num("elapsed_ms", events::millis(start.elapsed()))
+		.record("phases", phases.record())
+		.emit();
+	outcome
+}
+
+fn run_attempts(channel: &mut Scheduler, target: &mut Target, images: &[Image], options: &Options, stats: &mut Stats, phases: &mut Phases) -> Result<(), String> {
+	let tag = target.tag.clone();
+	let mut negotiated: Option<u8> = None;
+
+	loop {
+		let mut mark = Instant::now();
+		// Wait for message that device bootload is ready for program. Newer
+		// loaders say hello before erasing, and only erase what the image
+		// needs, as it arrives, if we answer with a send window.
+		// The loader starts over on the protocol's IDs
+		let mut errors = 0;
+		channel.ids = None;
+		let heartbeat = loop {
+			match loader::read_reply(channel, NO_TIMEOUT, &mut errors) {
+				Some(reply) => {
+					if reply.status == protocol::STATUS_HEARTBEAT {
+						break reply;
+					}
+					let window = window_size(&protocol::Caps::from_heartbeat(&reply), options);
+					if reply.status == protocol::STATUS_HELLO && window != 0 {
+						channel.write(protocol::DATA_ID, &protocol::command_frame(protocol::CMD_WINDOW, ack_interval(window)));
+					}
+				}
+				None => return Err(String::from("Receive failed while waiting for the heartbeat")),
+			}
+		};
+		note!("{} Found bootload heartbeat! Started bootload!", tag);
+		target.phase("heartbeat", &mut mark, &mut phases.heartbeat);
+		channel.flush();
+
+		// Newer loaders describe themselves in the heartbeat. Older ones only
+		// take one word per frame and no commands.
+		let caps = protocol::Caps::from_heartbeat(&heartbeat);
+		if caps.version == 0 {
+			note!("{} Loader does not report its capabilities, using one word frames", tag);
+		}
+		else {
+			note!("{} Loader version {}, modes {:#04x}, {} frame receive buffer", tag, caps.version, caps.modes, caps.ring_frames);
+		}
+
+		// Move to the fastest profile the harness handles. Retries go straight
+		// to the one found the first time.
+		if options.autobaud && !caps.supports(protocol::MODE_COMMANDS) {
+			note!("{} Loader does not support -autobaud, staying at {}", tag, protocol::profile_name(options.boot_profile));
+		}
+		else if options.autobaud {
+			let candidates = match negotiated {
+				Some(profile) => vec![profile],
+				None => protocol::PROFILE_ORDER.to_vec(),
+			};
+			let profile = autobaud::negotiate(channel, options.boot_profile, &candidates);
+			note!("{} Bootloading at {}", tag, protocol::profile_name(profile));
+			negotiated = Some(profile);
+			target.phase("autobaud", &mut mark, &mut phases.autobaud);
+		}
+
+		// Get out of the way of the bus's own traffic. A loader that can not
+		// move is bootloaded on the protocol's IDs, still within -budget.
+		if let Some((data_id, reply_id)) = options.ids {
+			if caps.version < 9 {
+				note!("{} Loader does not support -ids, staying on IDs {:#x} and {:#x}", tag, protocol::DATA_ID, protocol::REPLY_ID);
+			}
+			else {
+				match loader::command_data(channel, protocol::CMD_SET_IDS, 0, (data_id << 16) | reply_id as u32, &mut errors) {
+					Some(ref reply) if reply.status == protocol::STATUS_ACK => {
+						note!("{} Loader moved to IDs {:#x} and {:#x}", tag, data_id, reply_id);
+						channel.ids = options.ids;
+					}
+					_ => {
+						note!("{} Loader did not move to IDs {:#x} and {:#x}", tag, data_id, reply_id);
+						target.phase("slot", &mut mark, &mut phases.slot);
+						retry(channel, target, options, stats)?;
+						continue;
+					}
+				}
+			}
+		}
+
+		// How fast the loader takes frames out of its ring, against what the
+		// bus can bring it
+		if options.selftest && caps.version < 10 {
+			note!("{} Loader does not support -selftest", tag);
+		}
+		else if options.selftest {
+			let profile = negotiated.unwrap_or(options.boot_profile);
+			self_test(channel, target, &caps, profile, &mut errors);
+			target.phase("selftest", &mut mark, &mut phases.selftest);
+		}
+
+		// The heartbeat carries the slot the loader is about to write. Send the
+		// build linked for that slot, or the only image if there is just one.
+		// The slot's flash range comes from the loader when it can tell us.
+		// RAM loads need a build linked for RAM.
+		let slot = heartbeat.arg;
+		if options.ram != (slot == protocol::SLOT_RAM) {
+			return Err(String::from(if options.ram {
+				"Loader is not waiting for a RAM image, the application may not support -ram"
+			}
+			else {
+				"Loader is waiting for a RAM image, use -ram"
+			}));
+		}
+		let (slot_start, slot_end) = if options.ram {
+			(0, 0)
+		}
+		else if caps.supports(protocol::MODE_COMMANDS) {
+			match loader::command(channel, protocol::CMD_SLOT_INFO, slot as u8, &mut errors) {
+				Some(ref reply) if reply.status == protocol::STATUS_ACK => protocol::slot_range(reply),
+				_ => {
+					note!("{} Loader did not answer the slot query", tag);
+					target.phase("slot", &mut mark, &mut phases.slot);
+					retry(channel, target, options, stats)?;
+					continue;
+				}
+			}
+		}
+		else if (slot as usize) < image::SLOT_RANGES.len() {
+			image::SLOT_RANGES[slot as usize]
+		}
+		else {
+			(0, 0)
+		};
+		let linked = |image: &&Image| if options.ram { image.in_ram() } else { image.fits(slot_start, slot_end) };
+		let image = match images.iter().find(linked) {
+			Some(image) => image,
+			None if images.len() == 1 && !options.ram => {
+				note!("{} Warning: program is not linked for slot {}", tag, slot);
+				&images[0]
+			}
+			None if options.ram => return Err(String::from("No program file is linked for RAM")),
+			None => return Err(format!("No program file is linked for slot {}", slot)),
+		};
+
+		// With a window the loader acks as it programs and asks for lost
+		// frames again, so a fault costs one frame rather than the attempt.
+		let window = window_size(&caps, options);
+		if window != 0 {
+			match loader::command(channel, protocol::CMD_WINDOW, ack_interval(window), &mut errors) {
+				Some(ref reply) if reply.status == protocol::STATUS_ACK => {}
+				_ => {
+					note!("{} Loader did not take the send window", tag);
+					target.phase("slot", &mut mark, &mut phases.slot);
+					retry(channel, target, options, stats)?;
+					continue;
+				}
+			}
+		}
+
+		// Sectors that only need bits cleared against what the slot holds
+		// (-base, else the inventory) are programmed without erasing, and
+		// only the words that change are sent. The loader must not have
+		// erased the slot yet, so this needs the window. Retries erase as
+		// usual in case the slot did not hold what we were told.
+		let mut patched = None;
+		target.kept = 0;
+		if window != 0 && target.attempt == 0 && caps.supports(protocol::MODE_KEEP) && !options.ram {
+			let base = options.base.iter().find(|base| base.fits(slot_start, slot_end));
+			let mut patch = base.and_then(|base| image.patch(base, slot_start, slot_end));
+			// Take -base's word for it only when the slot cannot be asked
+			if let (Some(base), true) = (base, patch.is_some() && caps.supports(protocol::MODE_SLOT_CRC)) {
+				if !holds(channel, slot, protocol::slot_crc(base.crc16(), base.length()), &mut errors) {
+					note!("{} Slot {} does not hold the -base program, erasing as usual", tag, slot);
+					patch = None;
+				}
+			}
+			if let (None, Some(ref inventory)) = (patch.as_ref(), options.inventory.as_ref()) {
+				if caps.supports(protocol::MODE_SLOT_CRC) {
+					patch = reuse(channel, target, inventory, slot, image, (slot_start, slot_end), &mut errors);
+				}
+			}
+			if let Some((keep, patch)) = patch {
+				match loader::command(channel, protocol::CMD_KEEP, keep as u8, &mut errors) {
+					Some(ref reply) if reply.status == protocol::STATUS_ACK => {
+						note!("{} Programming sectors {} without erasing", tag, protocol::sector_names(keep));
+						target.kept = keep;
+						patched = Some(patch);
+					}
+					_ => note!("{} Loader did not take sectors {} to program without erasing", tag, protocol::sector_names(keep)),
+				}
+			}
+		}
+		let stream = patched.as_ref().unwrap_or(image);
+
+		// Loaders that know the CRC to expect do not mark an image that does
+		// not match it valid. Older ones can only be told afterwards.
+		if caps.version >= 11 {
+			match loader::command_data(channel, protocol::CMD_EXPECT_CRC, 0, image.crc16() as u32, &mut errors) {
+				Some(ref reply) if reply.status == protocol::STATUS_ACK => {}
+				_ => {
+					note!("{} Loader did not take the image CRC", tag);
+					target.phase("slot", &mut mark, &mut phases.slot);
+					retry(channel, target, options, stats)?;
+					continue;
+				}
+			}
+		}
+		target.phase("slot", &mut mark, &mut phases.slot);
+
+		// Save the application the device runs now before it is replaced.
+		// It lives in the other slot, which the loader never writes. No
+		// backup, no update.
+		if let (Some(ref prefix), false) = (options.dump.as_ref(), target.dumped || options.ram) {
+			if !caps.supports(protocol::MODE_READ) {
+				return Err(String::from("Loader does not support -dump"));
+			}
+			let path = format!("{}{}.a00", prefix, target.device);
+			let running = match image::SLOT_RANGES.get((slot ^ 1) as usize) {
+				Some(range) => range.0,
+				None => return Err(format!("Loader is writing unknown slot {}", slot)),
+			};
+			match dump::backup(channel, running, &path, &mut errors) {
+				Ok(words) => note!("{} Saved the running application, {} words, to {}", tag, words, path),
+				Err(e) => return Err(format!("Backup failed, {}", e)),
+			}
+			target.dumped = true;
+			target.phase("dump", &mut mark, &mut phases.dump);
+		}
+
+		// Start sending program to bootloader, as many words per frame as it
+		// takes. Without the window nothing holds the stream back while the
+		// loader programs, and three words per frame outrun a slow flash at
+		// 1 Mbit/s, so that goes one word per frame.
+		channel.flush();
+		let ring = stream.frames(words_per_frame(&caps, window));
+		let mut sent: u64 = 0;
+		let mut last = (mark, 0);
+		let mut reply = None;
+		let mut acked = 0;
+		let mut index = 0;
+		let mut pacer = Pacer::new(window, ack_interval(window) as usize, caps.ring_frames as usize);
+		while index < ring.len() {
+			if window != 0 && index - acked >= pacer.window {
+				// Window full, wait for the loader to catch up
+				match loader::read_reply(channel, REPLY_TIMEOUT, &mut errors) {
+					Some(answer) => {
+						reply = stream_reply(channel, &ring, &caps, index, &mut acked, &mut pacer, answer, stats);
+						if reply.is_some() {
+							break;
+						}
+					}
+					None => break,
+				}
+				continue;
+			}
+			let frame = ring.frame(index);
+			stats.retransmits += can_send_stream(channel, frame);
+			stats.frames += 1;
+			stats.bytes += frame.len() as u64;
+			sent += frame.len() as u64;
+			index += 1;
+			if pacer.gap_us != 0 {
+				channel.pause(pacer.gap_us);
+			}
+
+			if events::enabled() && events::millis(last.0.elapsed()) >= PROGRESS_INTERVAL_MS {
+				let now = Instant::now();
+				let record = target.event("progress")
+					.num("frames", index)
+					.num("frames_total", ring.len())
+					.num("bytes", sent)
+					.float("bytes_per_s", rate(sent - last.1, now - last.0))
+					.float("avg_bytes_per_s", rate(sent, now - mark))
+					.num("retransmits", stats.retransmits)
+					.num("window", pacer.window)
+					.num("gap_us", pacer.gap_us);
+				match stream.position(ring.words_before(index)) {
+					Some((block, address)) => record.num("block", block).num("address", address).emit(),
+					None => record.null("block").null("address").emit(),
+				}
+				last = (now, sent);
+			}
+
+			// Mid-stream the loader only answers with acks, NACKs and when it
+			// gives up. Stop there, since the rest would land in the ring of the
+			// restarted loader and fail its next attempt.
+			if index % POLL_FRAMES == 0 {
+				if let Some(answer) = loader::read_reply(channel, 0, &mut errors) {
+					reply = stream_reply(channel, &ring, &caps, index, &mut acked, &mut pacer, answer, stats);
+					if let Some(ref early) = reply {
+						note!("{} Loader stopped the stream at frame {} with status {:#06x}", tag, index, early.status);
+						break;
+					}
+				}
+			}
+		}
+		target.phase("send", &mut mark, &mut phases.send);
+
+		// Frames still in flight may need sending again before the result. A
+		// heartbeat means the loader never saw the stream.
+		while reply.is_none() {
+			match loader::read_reply(channel, REPLY_TIMEOUT, &mut errors) {
+				Some(ref answer) if answer.status == protocol::STATUS_HEARTBEAT => break,
+				Some(answer) => reply = stream_reply(channel, &ring, &caps, index, &mut acked, &mut pacer, answer, stats),
+				None => break,
+			}
+		}
+		if pacer.backoffs != 0 {
+			note!("{} Loader lost frames or saw bus errors, slowed down {} times to {} frames in flight and {} us between frames",
+				tag, pacer.backoffs, pacer.window, pacer.gap_us);
+		}
+		stats.backoffs += pacer.backoffs as u64;
+		if let Some(reply) = reply {
+			// Successful program message received. Bootloading complete
+			if reply.status == protocol::STATUS_SUCCESS {
+				note!("{} Bootloading completed successfully!", tag);
+				// Newer loaders skip erasing sectors that are already blank
+				target.blank = reply.arg;
+				if reply.arg != 0 {
+					note!("{} Sectors {} were blank and not erased", tag, protocol::sector_names(reply.arg));
+				}
+				if caps.supports(protocol::MODE_CRC) && reply.data as u16 != image.crc16() {
+					// The loader has already marked the slot valid and started
+					// it, so there is no loader left to send the image to again
+					target.phase("verify", &mut mark, &mut phases.verify);
+					return Err(format!("Loader CRC {:#06x} does not match the image CRC {:#06x}, the device now runs a corrupted image and must be put back into the loader by hand",
+						reply.data as u16, image.crc16()));
+				}
+				if let (false, Some(ref inventory)) = (options.ram, options.inventory.as_ref()) {
+					inventory.lock().unwrap().record(target.device, heartbeat.data, slot, inventory::Slot {
+						crc: image.crc16(),
+						length: image.length(),
+						sectors: image.sector_crcs(slot_start, slot_end),
+					});
+				}
+				target.phase("verify", &mut mark, &mut phases.verify);
+				return Ok(());
+			}
+			if reply.status == protocol::STATUS_FAIL_CRC {
+				note!("{} Loader CRC {:#06x} does not match the image CRC {:#06x}, the image was not marked valid",
+					tag, reply.data as u16, image.crc16());
+			}
+		}
+		target.phase("verify", &mut mark, &mut phases.verify);
+		retry(channel, target, options, stats)?;
+	}
+}
+
+// Sectors of slot the inventory says already hold what image writes there,
+// if one SLOT_CRC query confirms the record. A record the device does not
+// confirm is dropped.
+fn reuse(channel: &mut dyn Bus, target: &Target, inventory: &Mutex<Inventory>, slot: u16, image: &Image, range: (u32, u32), errors: &mut u32) -> Option<(u16, Image)> {
+	let (expected, patch) = {
+		let inventory = inventory.lock().unwrap();
+		let held = inventory.device(target.device).and_then(|entry| entry.slots.get(slot as usize)).and_then(|held| held.as_ref());
+		match held {
+			Some(held) => (protocol::slot_crc(held.crc, held.length), image.reuse(&held.sectors, range.0, range.1)),
+			None => return None,
+		}
+	};
+	if patch.is_none() {
+		return None;
+	}
+	if holds(channel, slot, expected, errors) {
+		return patch;
+	}
+	note!("{} Inventory record of slot {} is out of date", target.tag, slot);
+	inventory.lock().unwrap().forget(target.device, slot);
+	None
+}
+
+// True if the application header of slot gives the SLOT_CRC answer expected
+fn holds(channel: &mut dyn Bus, slot: u16, expected: u32, errors: &mut u32) -> bool {
+	match loader::command(channel, protocol::CMD_SLOT_CRC, slot as u8, errors) {
+		Some(ref reply) => reply.status == protocol::STATUS_ACK && reply.data == expected,
+		None => false,
+	}
+}
+
+// Program words per data frame for the send window in use
+pub fn words_per_frame(caps: &protocol::Caps, window: usize) -> usize {
+	if window != 0 { caps.words_per_frame() } else { 1 }
+}
+
+// Loop frames through the loader's receive path in eCAN self-test mode and
+// report its speed
+fn self_test(channel: &mut dyn Bus, target: &Target, caps: &protocol::Caps, profile: u8, errors: &mut u32) {
+	let reply = match loader::slow_command(channel, protocol::CMD_SELF_TEST, SELF_TEST_BATCHES, SELF_TEST_TIMEOUT, errors) {
+		Some(reply) => reply,
+		None => {
+			note!("{} Loader did not answer the self-test", target.tag);
+			return;
+		}
+	};
+	if reply.status != protocol::STATUS_ACK {
+		note!("{} Loader self-test lost frames", target.tag);
+		return;
+	}
+	let frames = SELF_TEST_BATCHES as u64 * caps.ring_frames as u64;
+	let cycles_per_frame = reply.data as f64 / frames as f64;
+	let frames_per_s = protocol::CPU_HZ as f64 / cycles_per_frame;
+	let (freq, _, _, _) = protocol::bus_params(profile);
+	let bus_frames_per_s = freq as f64 / bus::frame_bits(8) as f64;
+	note!("{} Loader receive path takes {:.0} cycles per frame before programming, {:.0} frames/s at {} MHz. The bus brings at most {:.0} frames/s at {} kbit/s.",
+		target.tag, cycles_per_frame, frames_per_s, protocol::CPU_HZ / 1000000, bus_frames_per_s, freq / 1000);
+	target.event("selftest")
+		.num("frames", frames)
+		.num("cycles", reply.data)
+		.float("cycles_per_frame", cycles_per_frame)
+		.float("frames_per_s", frames_per_s)
+		.float("bus_frames_per_s", bus_frames_per_s)
+		.emit();
+}
+
+// Count a failed attempt and get ready for the next heartbeat, unless out
+// of retries
+fn retry(channel: &mut dyn Bus, target: &mut Target, options: &Options, stats: &mut Stats) -> Result<(), String> {
+	target.attempt += 1;
+	if options.max_retries != 0 && target.attempt > options.max_retries {
+		return Err(format!("Bootloading failed after {} retries", options.max_retries));
+	}
+	stats.retries += 1;
+	note!("{} Bootloading failed! Waiting for bootload heartbeat for retry ...", target.tag);
+	// The loader restarts in the profile it was handed
+	loader::set_profile(channel, options.boot_profile);
+	Ok(())
+}
+
+// Frames to keep in flight, 0 if the loader takes no window
+fn window_size(caps: &protocol::Caps, options: &Options) -> usize {
+	if caps.supports(protocol::MODE_WINDOW) {
+		::std::cmp::min(options.window, caps.ring_frames as usize)
+	}
+	else {
+		0
+	}
+}
+
+// Frames per window ack. Acks every half window keep the pipe full.
+fn ack_interval(window: usize) -> u8 {
+	::std::cmp::max(window / 2, 1) as u8
+}
+
+// Handle a reply that came in while streaming. Window acks move acked on
+// and a NACK sends the missing frame again, both pass the loader's health
+// report to pacer. Returns any other reply but a heartbeat, which ends the
+// stream. sent is the number of frames sent.
+fn stream_reply(channel: &mut dyn Bus, ring: &FrameRing, caps: &protocol::Caps, sent: usize, acked: &mut usize, pacer: &mut Pacer, reply: protocol::Reply, stats: &mut Stats) -> Option<protocol::Reply> {
+	// Older loaders only send the 16 bit sequence number, count on from the
+	// last ack. Frames in flight are far fewer than 65536.
+	let position = if caps.supports(protocol::MODE_POSITION) {
+		reply.data as usize
+	}
+	else {
+		*acked + (reply.data as u16).wrapping_sub(*acked as u16) as usize
+	};
+	if reply.status == protocol::STATUS_WINDOW {
+		pacer.report(reply.arg);
+		if position <= sent {
+			*acked = position;
+		}
+	}
+	else if reply.status == protocol::STATUS_NACK {
+		pacer.report(reply.arg);
+		// The frame at position n is ring.frame(n - 1)
+		if position >= 1 && position <= sent {
+			*acked = position - 1;
+			let frame = ring.frame(position - 1);
+			stats.retransmits += can_send_stream(channel, frame) + 1;
+			stats.frames += 1;
+			stats.bytes += frame.len() as u64;
+		}
+	}
+	else if reply.status != protocol::STATUS_HEARTBEAT {
+		return Some(reply);
+	}
+	None
+}
+
+// Returns how many times the frame had to be sent again
+fn can_send_stream(channel: &mut dyn Bus, frame: &[u8]) -> u64
+{
+	let mut retransmits = 0;
+	let mut result = channel.write(protocol::DATA_ID, frame);
+	while result != 0 {
+		note!("Failed to send CAN message: {:?}", frame);
+		result = channel.write(protocol::DATA_ID, frame);
+		retransmits += 1;
+	}
+	retransmits
+}
+
+fn rate(bytes: u64, elapsed: Duration) -> f64 {
+	bytes as f64 / (elapsed.as_secs() as f64 + elapsed.subsec_nanos() as f64 / 1e9)
+}
@@ -0,0 +1,1022 @@
+// Simulated F28035 loader on a virtual bus, for -bench. The loader follows
+// Bootload() in CAN_Boot.c frame by frame. Time is simulated rather than
+// measured: frames take their bit time on the bus and the loader takes the
+// flash and CPU times below, so every run gives the same numbers.
+use std::cmp::{max, min};
+use std::collections::VecDeque;
+use canlib::{Frame, MSG_ERROR_FRAME, NO_TIMEOUT};
+use bus;
+use bus::Bus;
+use protocol::*;
+use image;
+
+// canlib error codes
+const ERR_PARAM: i16 = -1;
+const ERR_NOMSG: i16 = -2;
+const ERR_TIMEOUT: i16 = -7;
+
+// Loader CPU time, at 60 MHz
+const ISR_NS: u64 = 1500;			// CAN_RxIsr, per frame
+const FRAME_NS: u64 = 3000;			// Ring, sequence check and unpacking
+const SEARCH_NS: u64 = 300;			// Looking for a missing frame, per ring entry
+const WORD_NS: u64 = 500;			// Stream state machine, per word
+const COMMAND_NS: u64 = 10000;
+const CRC_NS: u64 = 500;			// CRC16_Calc(), per word
+const BLANK_NS: u64 = 100;			// Slot_EraseTo() blank check, per word
+const BOOT_NS: u64 = 20000000;		// Reset to Flash_Erase(): boot ROM, PLL, slot CRC checks
+const HEARTBEAT_NS: u64 = 400000000;	// 3M passes of the ring wait loop
+const HELLO_NS: u64 = 50000000;		// HELLO_WAIT
+const PROFILE_REVERT_BEATS: u32 = 4;
+const STREAM_STALL_BEATS: u32 = 4;
+
+// Host side
+const WRITE_LATENCY_NS: u64 = 20000;	// Turnaround after canWriteWait() returns
+const WRITE_TIMEOUT_NS: u64 = 10000000;	// canWriteWait() timeout when nobody acks
+const LONGEST_WAIT_NS: u64 = 120000000000;	// Stands in for NO_TIMEOUT
+const READ_STEP_NS: u64 = 1000000;
+const ERROR_FRAME_BITS: u64 = 20;
+const BUS_OFF_BITS: u64 = 128 * 11;	// Bus off recovery: 128 runs of 11 recessive bits
+
+const DEVICE_BITRATE: i32 = 1000000;	// The application's own bit rate
+const HEADER_WORDS: u64 = 16;
+const FLASH_SUCCESS: u16 = 0xAAAA;
+const REPLY_BITS: u64 = 135;			// 8 byte reply frame, worst case stuffing
+const SLOT_MASKS: [u32; 2] = [0xE0, 0x1C];	// SECTORH|G|F, SECTORE|D|C
+const SECTOR_WORDS: u32 = 0x2000;
+const FLASH_TOP: u32 = 0x3F7FFF;		// Last word of sector A
+
+// Flash_Program() and Flash_Erase() times
+pub struct FlashTiming {
+	pub name: &'static str,
+	pub program_ns: u64,	// Per 16 bit word
+	pub erase_ns: u64,		// Per sector
+}
+
+// F2803x data sheet typical values, and a device twice as slow for aged
+// parts or low temperature
+pub const FLASH_TYPICAL: FlashTiming = FlashTiming { name: "typical", program_ns: 50000, erase_ns: 2000000000 };
+pub const FLASH_SLOW: FlashTiming = FlashTiming { name: "slow", program_ns: 100000, erase_ns: 4000000000 };
+
+// Faults injected into data frames, see parse_faults()
+#[derive(Clone, Copy, PartialEq)]
+pub enum Fault {
+	Drop,		// Acknowledged by another node but missed by the loader
+	Duplicate,	// Received twice, as after a lost acknowledge
+	Reorder,	// Reaches the loader after the frame behind it
+	BitError,	// Cut short by an error frame and sent again
+	BusOff,		// The host controller goes bus off instead of sending it
+}
+
+#[derive(Clone, Copy)]
+pub struct Injection {
+	pub fault: Fault,
+	pub first: u64,		// Stream frame written, counted from 1 over every attempt
+	pub every: u64,		// Repeat interval in frames, 0 for once
+}
+
+impl Injection {
+	fn hits(&self, frame: u64) -> bool {
+		frame == self.first || (self.every != 0 && frame > self.first && (frame - self.first) % self.every == 0)
+	}
+}
+
+// Comma separated list of fault@frame or fault@frame/interval, where fault
+// is drop, dup, reorder, biterr or busoff
+pub fn parse_faults(spec: &str) -> Result<Vec<Injection>, String> {
+	let mut faults = Vec::new();
+	for item in spec.split(',').filter(|item| !item.is_empty()) {
+		let mut parts = item.splitn(2, '@');
+		let fault = match parts.next().unwrap_or("") {
+			"drop" => Fault::Drop,
+			"dup" => Fault::Duplicate,
+			"reorder" => Fault::Reorder,
+			"biterr" => Fault::BitError,
+			"busoff" => Fault::BusOff,
+			name => return Err(format!("Unknown fault {}", name)),
+		};
+		let mut schedule = parts.next().unwrap_or("").splitn(2, '/');
+		let first = schedule.next().unwrap_or("").parse::<u64>();
+		let every = schedule.next().unwrap_or("0").parse::<u64>();
+		match (first, every) {
+			(Ok(first), Ok(every)) if first > 0 => faults.push(Injection { fault: fault, first: first, every: every }),
+			_ => return Err(format!("Bad fault schedule in {}", item)),
+		}
+	}
+	Ok(faults)
+}
+
+pub struct Config {
+	pub device: u32,		// Command ID the application listens on
+	pub version: u8,		// 0 for a loader without the capability report
+	pub modes: u8,
+	pub ring_frames: usize,
+	pub profile: u8,		// Profile handed to the loader
+	pub flash: &'static FlashTiming,
+	pub loss: f64,			// Chance a frame is hit by a bus error
+	pub seed: u64,
+	pub faults: Vec<Injection>,
+}
+
+// Times from the last stream the host started
+#[derive(Default, Clone, Copy)]
+pub struct Metrics {
+	pub send_ns: u64,		// First data frame to the final reply
+	pub bus_ns: u64,		// Bus busy with frames or error frames meanwhile
+	pub cpu_ns: u64,		// Loader CPU busy meanwhile
+	pub overruns: u32,		// Frames dropped with the ring full, all streams
+}
+
+enum Stage {
+	Application,
+	Booting(u64),		// Until Bootload() says hello
+	Hello(u64),			// Until the hello wait runs out
+	Erasing(u64),
+	Receiving,
+}
+
+// Stream state, see STREAM_x
+#[derive(PartialEq)]
+enum Stream {
+	Header,
+	Size,
+	Addr,
+	Data,
+}
+
+struct Loader {
+	config: Config,
+	stage: Stage,
+	profile: u8,
+	idle_beats: u32,
+	active_slot: u16,
+	slot: u16,
+	headers: [u32; 2],		// SLOT_CRC answer for each slot
+	ring: VecDeque<(u64, [u8; 8], usize)>,
+	busy_until: u64,
+	next_beat: u64,
+	outbox: VecDeque<(u64, u8, u16, [u8; 8])>,	// Send time, profile, ID, data
+	data_id: u32,			// See SET_IDS
+	reply_id: u16,
+	count: u32,
+	ack_interval: u16,
+	expected_crc: Option<u16>,	// See EXPECT_CRC
+	since_ack: u16,
+	nacked: u32,
+	gap: Option<usize>,		// Ring length when a missing frame was last looked for
+	erased: u32,			// SECTORx mask
+	blank: u32,				// Erased sectors that were blank already
+	stream: Stream,
+	index: u32,
+	block_size: u32,
+	dest: u32,
+	entry: u32,
+	image_start: u32,
+	image_end: u32,
+	flash: Vec<u16>,
+	cpu_ns: u64,
+	overruns: u32,
+	lost_seen: u32,			// overruns at the last health report
+	rec: u32,				// CANREC
+}
+
+fn reply(arg: u16, status: u16, data: u32) -> [u8; 8] {
+	[(arg >> 8) as u8, arg as u8, (status >> 8) as u8, status as u8,
+	 (data >> 24) as u8, (data >> 16) as u8, (data >> 8) as u8, data as u8]
+}
+
+fn sequence(data: &[u8; 8]) -> u16 {
+	((data[0] as u16) << 8) | data[1] as u16
+}
+
+// SECTORx mask of the sector holding address
+fn sector_bit(address: u32) -> u32 {
+	1 << ((FLASH_TOP - address) / SECTOR_WORDS)
+}
+
+fn slot_start(slot: u16) -> u32 {
+	image::SLOT_RANGES[slot as usize].0
+}
+
+impl Loader {
+	fn caps(&self) -> u32 {
+		if self.config.version == 0 {
+			return 0;
+		}
+		(0xCA << 24) | ((self.config.version as u32) << 16) | ((self.config.modes as u32) << 8) | (self.config.ring_frames as u32 & 0xFF)
+	}
+
+	fn send(&mut self, time: u64, data: [u8; 8]) {
+		let (profile, id) = (self.profile, self.reply_id);
+		self.outbox.push_back((time, profile, id, data));
+	}
+
+	// CAN_RxHealth(), 0 before version 8
+	fn health(&mut self) -> u16 {
+		if self.config.version < 8 {
+			return 0;
+		}
+		let lost = min(self.overruns - self.lost_seen, 0xFF) as u16;
+		self.lost_seen = self.overruns;
+		(lost << 8) | min(self.rec, 0xFF) as u16
+	}
+
+	fn heartbeat(&mut self, time: u64) {
+		let (slot, caps) = (self.slot, self.caps());
+		self.send(time, reply(slot, STATUS_HEARTBEAT, caps));
+	}
+
+	// Slot_EraseTo(): erase the sectors from the slot start up to the one
+	// holding end that are not erased yet, unless they are blank. Returns
+	// the time it takes.
+	fn erase_to(&mut self, end: u32) -> u64 {
+		let sectors = ((sector_bit(slot_start(self.slot)) << 1) - sector_bit(end)) & !self.erased;
+		self.erased |= sectors;
+		let base = image::SLOT_RANGES[0].0;
+		let mut time = 0;
+		for bit in 0..8 {
+			if sectors & (1 << bit) != 0 {
+				let start = (FLASH_TOP + 1 - (bit + 1) * SECTOR_WORDS - base) as usize;
+				let sector = &mut self.flash[start..start + SECTOR_WORDS as usize];
+				let scanned = sector.iter().position(|&word| word != 0xFFFF);
+				time += scanned.unwrap_or(sector.len()) as u64 * BLANK_NS;
+				match scanned {
+					Some(_) => {
+						for word in sector.iter_mut() {
+							*word = 0xFFFF;
+						}
+						time += self.config.flash.erase_ns;
+						if 1 << bit == sector_bit(slot_start(self.slot)) {
+							self.headers[self.slot as usize] = 0xFFFFFFFF;
+						}
+					}
+					None => self.blank |= 1 << bit,
+				}
+			}
+		}
+		time
+	}
+
+	// Run the loader up to time
+	fn advance(&mut self, time: u64) {
+		loop {
+			match self.stage {
+				Stage::Application => return,
+				Stage::Booting(until) => {
+					if until > time {
+						return;
+					}
+					// CAN_Boot() picks the slot that is not running and Bootload()
+					// says hello with the receive interrupt already on
+					self.slot = if self.active_slot == 0 { 1 } else { 0 };
+					self.profile = self.config.profile;
+					self.ring.clear();
+					self.count = 0;
+					self.ack_interval = 0;
+					self.expected_crc = None;
+					self.since_ack = 0;
+					self.nacked = 0;
+					self.lost_seen = self.overruns;
+					self.data_id = DATA_ID;
+					self.reply_id = REPLY_ID;
+					self.gap = None;
+					self.idle_beats = 0;
+					self.stream = Stream::Header;
+					self.index = 0;
+					self.image_start = 0xFFFFFFFF;
+					self.image_end = slot_start(self.slot);
+					self.erased = 0;
+					self.blank = 0;
+					if self.config.version >= 4 {
+						let (slot, caps) = (self.slot, self.caps());
+						self.send(until, reply(slot, STATUS_HELLO, caps));
+						self.outbox.back_mut().unwrap().2 = HELLO_ID;
+						self.stage = Stage::Hello(until + HELLO_NS);
+					}
+					else {
+						let end = image::SLOT_RANGES[self.slot as usize].1;
+						let erase_ns = self.erase_to(end);
+						self.stage = Stage::Erasing(until + erase_ns);
+					}
+				}
+				Stage::Hello(deadline) => {
+					// The first frame in time decides, a window means lazy erase
+					let answer = match self.ring.front() {
+						Some(&(arrival, data, _)) if arrival <= deadline => Some((arrival, data)),
+						_ => None,
+					};
+					let decided = answer.map_or(deadline, |(arrival, _)| arrival);
+					if decided > time {
+						return;
+					}
+					let paced = answer.map_or(false, |(_, data)| sequence(&data) == 0 && data[2] == CMD_WINDOW && data[3] != 0);
+					let erase_ns = if paced { 0 } else {
+						let end = image::SLOT_RANGES[self.slot as usize].1;
+						self.erase_to(end)
+					};
+					self.stage = Stage::Erasing(decided + erase_ns);
+				}
+				Stage::Erasing(until) => {
+					if until > time {
+						return;
+					}
+					self.stage = Stage::Receiving;
+					self.busy_until = until;
+					self.heartbeat(until);
+					self.next_beat = until + HEARTBEAT_NS;
+				}
+				Stage::Receiving => {
+					// Past a gap only frames that came in since wake the loader
+					let pending = match self.gap {
+						Some(seen) => self.ring.get(seen),
+						None => self.ring.front(),
+					};
+					let start = match pending {
+						Some(&(arrival, _, _)) => max(arrival, self.busy_until),
+						None => u64::max_value(),
+					};
+					if self.next_beat < start {
+						if self.next_beat > time {
+							return;
+						}
+						let beat = self.next_beat;
+						self.next_beat = beat + HEARTBEAT_NS;
+						self.idle_beats += 1;
+						if self.count != 0 {
+							// Stalled stream
+							if self.idle_beats >= STREAM_STALL_BEATS {
+								self.fail(beat, 0, 0xFFFF);
+							}
+							else if self.ack_interval != 0 {
+								let missing = self.count + 1;
+								let health = self.health();
+								self.send(beat, reply(health, STATUS_NACK, missing));
+							}
+							continue;
+						}
+						// A host that could not follow a profile switch goes quiet
+						if self.profile != self.config.profile && self.idle_beats >= PROFILE_REVERT_BEATS {
+							self.profile = self.config.profile;
+						}
+						self.heartbeat(beat);
+						continue;
+					}
+					if start > time {
+						return;
+					}
+					self.take(start);
+				}
+			}
+		}
+	}
+
+	// Handle the frame at the ring tail, starting at time start
+	fn take(&mut self, start: u64) {
+		let mut cost = ISR_NS + FRAME_NS;
+		let seq = sequence(&self.ring[0].1);
+
+		if self.count == 0 && seq == 0 && self.config.modes & MODE_COMMANDS != 0 {
+			let (_, data, _) = self.ring.pop_front().unwrap();
+			let (command, argument) = (data[2], data[3]);
+			cost += COMMAND_NS;
+			self.idle_beats = 0;
+			let done = start + cost;
+			if command == CMD_PING {
+				self.send(done, reply(command as u16, STATUS_ACK, 0));
+			}
+			else if command == CMD_SLOT_INFO && argument < 2 {
+				let info = (SLOT_MASKS[argument as usize] << 24) | slot_start(argument as u16);
+				self.send(done, reply(command as u16, STATUS_ACK, info));
+			}
+			else if command == CMD_SLOT_CRC && self.config.modes & MODE_SLOT_CRC != 0 && argument < 2 {
+				let header = self.headers[argument as usize];
+				self.send(done, reply(command as u16, STATUS_ACK, header));
+			}
+			else if command == CMD_READ && self.config.modes & MODE_READ != 0 && argument != 0 && self.reads(&data) {
+				// The model only holds the slots, not sectors B and A
+				let base = image::SLOT_RANGES[0].0;
+				let addr = (data[4] as u32) << 24 | (data[5] as u32) << 16 | (data[6] as u32) << 8 | data[7] as u32;
+				let offset = (addr - base) as usize;
+				let words = self.flash[offset..offset + 4 * argument as usize].to_vec();
+				let frame_ns = REPLY_BITS * 1000000000 / bus_params(self.profile).0 as u64;
+				let mut at = done;
+				for chunk in words.chunks(4) {
+					self.send(at, reply(chunk[0], chunk[1], (chunk[2] as u32) << 16 | chunk[3] as u32));
+					at += frame_ns;
+				}
+				cost += at - done + words.len() as u64 * CRC_NS;
+				self.send(start + cost, reply(command as u16, STATUS_ACK, image::crc16_ccitt(&words) as u32));
+			}
+			else if command == CMD_SET_IDS && self.config.version >= 9 && data[4] < 8 && data[6] < 8 && data[4..6] != data[6..8] {
+				// Acknowledged on the old IDs
+				let ids = (data[4] as u32) << 24 | (data[5] as u32) << 16 | (data[6] as u32) << 8 | data[7] as u32;
+				self.send(done, reply(command as u16, STATUS_ACK, ids));
+				self.data_id = ids >> 16;
+				self.reply_id = ids as u16;
+			}
+			else if command == CMD_SELF_TEST && self.config.version >= 10 && argument != 0 && self.ring.is_empty() {
+				// CAN_RxBench(): each frame goes round at the bit rate, then the
+				// batch is taken out of the ring, which is what gets timed
+				let frames = argument as u64 * self.config.ring_frames as u64;
+				let frame_ns = REPLY_BITS * 1000000000 / bus_params(self.profile).0 as u64;
+				let taken_ns = frames * (FRAME_NS + 3 * WORD_NS);
+				cost += frames * (frame_ns + ISR_NS) + taken_ns;
+				self.send(start + cost, reply(command as u16, STATUS_ACK, (taken_ns * CPU_HZ / 1000000000) as u32));
+			}
+			else if command == CMD_EXPECT_CRC && self.config.version >= 11 && data[4..6] == [0, 0] {
+				self.expected_crc = Some((data[6] as u16) << 8 | data[7] as u16);
+				self.send(done, reply(command as u16, STATUS_ACK, (data[6] as u32) << 8 | data[7] as u32));
+			}
+			else if command == CMD_SET_PROFILE && argument <= PROFILE_MAX {
+				self.send(done, reply(command as u16, STATUS_ACK, argument as u32));
+				self.profile = argument;
+				self.heartbeat(done);
+			}
+			else if command == CMD_WINDOW && self.config.modes & MODE_WINDOW != 0 && argument as usize <= self.config.ring_frames {
+				self.ack_interval = argument as u16;
+				self.send(done, reply(command as u16, STATUS_ACK, argument as u32));
+			}
+			else if command == CMD_KEEP && self.config.modes & MODE_KEEP != 0 && argument != 0 &&
+				argument as u32 & self.erased == 0 &&
+				argument as u32 & !(SLOT_MASKS[self.slot as usize] & !sector_bit(slot_start(self.slot))) == 0 {
+				self.erased |= argument as u32;
+				self.send(done, reply(command as u16, STATUS_ACK, argument as u32));
+			}
+			else {
+				self.send(done, reply(command as u16, 0xFFFA, 0));
+			}
+			self.finish(start, cost);
+			return;
+		}
+
+		// Out of order frames, see the WINDOW notes in CAN_Boot.c
+		let expected = self.count + 1;
+		if seq != expected as u16 {
+			if self.ack_interval == 0 {
+				return self.fail(start, cost, 0xFFFF);
+			}
+			if seq.wrapping_sub(expected as u16) >= 0x8000 {
+				// Already programmed
+				self.ring.pop_front();
+				return self.finish(start, cost);
+			}
+			cost += SEARCH_NS * self.ring.len() as u64;
+			match self.ring.iter().position(|&(_, ref data, _)| sequence(data) == expected as u16) {
+				Some(k) => self.ring.swap(0, k),
+				None => {
+					if self.nacked != expected {
+						self.nacked = expected;
+						let health = self.health();
+						self.send(start + cost, reply(health, STATUS_NACK, expected));
+					}
+					self.gap = Some(self.ring.len());
+					return self.finish(start, cost);
+				}
+			}
+		}
+		let (_, data, dlc) = self.ring.pop_front().unwrap();
+		self.count = expected;
+		self.gap = None;
+		self.idle_beats = 0;
+
+		let words = if dlc > 2 { (dlc - 2) / 2 } else { 0 };
+		for k in 0..words {
+			let word = data[2 + 2 * k] as u16 | ((data[3 + 2 * k] as u16) << 8);
+			cost += WORD_NS;
+			match self.stream {
+				Stream::Data => {
+					cost += self.config.flash.program_ns;
+					let offset = self.dest.wrapping_sub(image::SLOT_RANGES[0].0) as usize;
+					if offset < self.flash.len() {
+						// Flash_Program() can not set a bit
+						if self.flash[offset] & word != word {
+							return self.fail(start, cost, 0xFFFC);
+						}
+						self.flash[offset] = word;
+					}
+					self.dest += 1;
+					self.index += 1;
+					if self.index == self.block_size {
+						self.stream = Stream::Size;
+					}
+				}
+				Stream::Header => {
+					if self.index == 0 && word != image::KEY_VALUE {
+						return self.fail(start, cost, 0xFFFD);
+					}
+					if self.index == 9 {
+						self.entry = (word as u32) << 16;
+					}
+					if self.index == 10 {
+						self.entry |= word as u32;
+						self.stream = Stream::Size;
+					}
+					self.index += 1;
+				}
+				Stream::Size => {
+					if word == 0 {
+						return self.complete(start, cost);
+					}
+					self.block_size = word as u32;
+					self.stream = Stream::Addr;
+					self.index = 0;
+				}
+				Stream::Addr => {
+					self.index += 1;
+					if self.index < 2 {
+						self.dest = (word as u32) << 16;
+						continue;
+					}
+					self.dest |= word as u32;
+					let (first, last) = image::SLOT_RANGES[self.slot as usize];
+					if self.dest < first + HEADER_WORDS as u32 || self.dest + self.block_size > last + 1 {
+						return self.fail(start, cost, 0xFFFB);
+					}
+					self.image_start = ::std::cmp::min(self.image_start, self.dest);
+					self.image_end = max(self.image_end, self.dest + self.block_size);
+					let end = self.image_end - 1;
+					cost += self.erase_to(end);
+					self.stream = Stream::Data;
+					self.index = 0;
+				}
+			}
+		}
+		if self.ack_interval != 0 {
+			self.since_ack += 1;
+			if self.since_ack >= self.ack_interval {
+				self.since_ack = 0;
+				let count = self.count;
+				let health = self.health();
+				self.send(start + cost, reply(health, STATUS_WINDOW, count));
+			}
+		}
+		self.finish(start, cost);
+	}
+
+	fn finish(&mut self, start: u64, cost: u64) {
+		self.busy_until = start + cost;
+		self.cpu_ns += cost;
+		self.next_beat = self.busy_until + HEARTBEAT_NS;
+	}
+
+	// True if the READ in data asks for flash the model holds
+	fn reads(&self, data: &[u8; 8]) -> bool {
+		let addr = (data[4] as u32) << 24 | (data[5] as u32) << 16 | (data[6] as u32) << 8 | data[7] as u32;
+		let end = addr as u64 + 4 * data[3] as u64;
+		addr >= image::SLOT_RANGES[0].0 && end <= image::SLOT_RANGES[1].1 as u64 + 1
+	}
+
+	// Failure reply, then the loader resets and starts over
+	fn fail(&mut self, start: u64, cost: u64, status: u16) {
+		self.finish(start, cost);
+		let done = self.busy_until;
+		self.send(done, reply(0, status, 0xFFFF));
+		self.stage = Stage::Booting(done + BOOT_NS);
+	}
+
+	// Header CRC and programming, success reply, then the new application runs
+	fn complete(&mut self, start: u64, mut cost: u64) {
+		if self.image_end <= self.image_start {
+			self.image_start = slot_start(self.slot) + HEADER_WORDS as u32;
+			self.image_end = self.image_start;
+		}
+		let base = image::SLOT_RANGES[0].0;
+		let span = &self.flash[(self.image_start - base) as usize..(self.image_end - base) as usize];
+		let crc = image::crc16_ccitt(span);
+		cost += span.len() as u64 * CRC_NS;
+		if self.expected_crc.map_or(false, |expected| expected != crc) {
+			// The header stays blank, the slot is not valid
+			self.finish(start, cost);
+			let done = self.busy_until;
+			self.send(done, reply(0, STATUS_FAIL_CRC, crc as u32));
+			self.stage = Stage::Booting(done + BOOT_NS);
+			return;
+		}
+		cost += HEADER_WORDS * self.config.flash.program_ns;
+		let header = slot_start(self.slot);
+		cost += self.erase_to(header);
+		self.program_header(crc);
+		self.finish(start, cost);
+		let done = self.busy_until;
+		let blank = self.blank as u16;
+		self.send(done, reply(blank, STATUS_SUCCESS, crc as u32));
+		self.headers[self.slot as usize] = slot_crc(crc, self.image_end - self.image_start);
+		self.active_slot = self.slot;
+		self.stage = Stage::Application;
+	}
+
+	// struct APP_HEADER, 32 bit fields low word first
+	fn program_header(&mut self, crc: u16) {
+		let base = image::SLOT_RANGES[0].0;
+		let other = (slot_start(self.slot ^ 1) - base) as usize;
+		let sequence = if self.flash[other] == FLASH_SUCCESS {
+			(self.flash[other + 6] as u32 | (self.flash[other + 7] as u32) << 16) + 1
+		}
+		else {
+			1
+		};
+		let length = self.image_end - self.image_start;
+		let fields = [self.image_start, length, sequence, self.entry];
+		let offset = (slot_start(self.slot) - base) as usize;
+		self.flash[offset] = FLASH_SUCCESS;
+		self.flash[offset + 1] = crc;
+		for (k, field) in fields.iter().enumerate() {
+			self.flash[offset + 2 + 2 * k] = *field as u16;
+			self.flash[offset + 3 + 2 * k] = (*field >> 16) as u16;
+		}
+	}
+
+	// Frame from the host, on the bus at time
+	fn receive(&mut self, time: u64, id: u32, data: &[u8]) {
+		let mut frame = [0u8; 8];
+		frame[..data.len()].copy_from_slice(data);
+		match self.stage {
+			Stage::Application => {
+				if id == self.config.device && data.len() == 8 && data.iter().all(|&b| b == 0xFF) {
+					self.stage = Stage::Booting(time + BOOT_NS);
+				}
+			}
+			Stage::Booting(_) => {}
+			Stage::Hello(_) | Stage::Erasing(_) | Stage::Receiving => {
+				if id != self.data_id {
+					return;
+				}
+				// CAN_RxIsr drops the frame when the ring is full
+				if self.ring.len() >= self.config.ring_frames {
+					self.overruns += 1;
+				}
+				else {
+					self.ring.push_back((time, frame, data.len()));
+				}
+			}
+		}
+	}
+
+	// Bit rate and timing the loader is listening at
+	fn params(&self) -> (i32, u32, u32) {
+		match self.stage {
+			Stage::Application => (DEVICE_BITRATE, 0, 0),
+			_ => {
+				let (freq, tseg1, tseg2, _) = bus_params(self.profile);
+				(freq, tseg1, tseg2)
+			}
+		}
+	}
+}
+
+pub struct SimBus {
+	loader: Loader,
+	now: u64,
+	bus_free: u64,
+	host: (i32, u32, u32),		// Bit rate, tseg1, tseg2. Zero tseg1 matches any timing.
+	rx: VecDeque<(u64, Frame)>,
+	errors: (u32, u32),
+	random: u64,
+	data_frames: u64,
+	held: Option<([u8; 8], usize)>,		// Reordered frame, delivered after the next one
+	bus_off_until: u64,
+	send_start: u64,
+	bus_ns: u64,
+	busy_ns: u64,			// Bus busy, since the start
+	load_from: (u64, u64),	// Time and busy_ns at the last bus_load()
+	metrics: Metrics,
+}
+
+impl SimBus {
+	pub fn new(config: Config) -> SimBus {
+		let base = image::SLOT_RANGES[0].0;
+		let size = (image::SLOT_RANGES[1].1 + 1 - base) as usize;
+		let seed = config.seed | 1;
+		SimBus {
+			loader: Loader {
+				config: config,
+				stage: Stage::Application,
+				profile: PROFILE_DEFAULT,
+				idle_beats: 0,
+				active_slot: 0,
+				headers: [0xFFFFFFFF; 2],
+				slot: 1,
+				ring: VecDeque::new(),
+				busy_until: 0,
+				next_beat: 0,
+				outbox: VecDeque::new(),
+				data_id: DATA_ID,
+				reply_id: REPLY_ID,
+				count: 0,
+				ack_interval: 0,
+				expected_crc: None,
+				since_ack: 0,
+				nacked: 0,
+				gap: None,
+				erased: 0,
+				blank: 0,
+				stream: Stream::Header,
+				index: 0,
+				block_size: 0,
+				dest: 0,
+				entry: 0,
+				image_start: 0,
+				image_end: 0,
+				// Both slots hold an older application, so every sector
+				// needs erasing the first time
+				flash: vec![0; size],
+				cpu_ns: 0,
+				overruns: 0,
+				lost_seen: 0,
+				rec: 0,
+			},
+			now: 0,
+			bus_free: 0,
+			host: (0, 0, 0),
+			rx: VecDeque::new(),
+			errors: (0, 0),
+			random: seed,
+			data_frames: 0,
+			held: None,
+			bus_off_until: 0,
+			send_start: 0,
+			bus_ns: 0,
+			busy_ns: 0,
+			load_from: (0, 0),
+			metrics: Metrics::default(),
+		}
+	}
+
+	// Simulated time since the start, ns
+	pub fn now(&self) -> u64 {
+		self.now
+	}
+
+	pub fn metrics(&self) -> Metrics {
+		let mut metrics = self.metrics;
+		metrics.overruns = self.loader.overruns;
+		metrics
+	}
+
+	fn bit_ns(&self) -> u64 {
+		1000000000 / self.host.0 as u64
+	}
+
+	fn frame_ns(&self, dlc: usize) -> u64 {
+		bus::frame_bits(dlc) * self.bit_ns()
+	}
+
+	// xorshift64, so runs repeat exactly
+	fn chance(&mut self) -> f64 {
+		self.random ^= self.random << 13;
+		self.random ^= self.random >> 7;
+		self.random ^= self.random << 17;
+		(self.random >> 11) as f64 / (1u64 << 53) as f64
+	}
+
+	fn hears(&self) -> bool {
+		let (freq, tseg1, tseg2) = self.loader.params();
+		self.host.0 == freq && (self.host.1 == 0 || tseg1 == 0 || (self.host.1, self.host.2) == (tseg1, tseg2))
+	}
+
+	// Move what the loader sent by time into the receive queue
+	fn collect(&mut self, time: u64) {
+		self.loader.advance(time);
+		while self.loader.outbox.front().map_or(false, |&(at, _, _, _)| at <= time) {
+			let (at, profile, id, data) = self.loader.outbox.pop_front().unwrap();
+			let start = max(at, self.bus_free);
+			let busy = self.frame_ns(8);
+			self.bus_free = start + busy;
+			self.bus_ns += busy;
+			self.busy_ns += busy;
+
+			let (freq, tseg1, tseg2, _) = bus_params(profile);
+			let heard = self.host.0 == freq && (self.host.1 == 0 || (self.host.1, self.host.2) == (tseg1, tseg2));
+			let frame = if heard {
+				Frame { id: id as i32, data: data, flags: 0 }
+			}
+			else {
+				self.errors.1 += 1;
+				Frame { id: 0, data: [0; 8], flags: MSG_ERROR_FRAME }
+			};
+			let status = ((data[2] as u16) << 8) | data[3] as u16;
+			if status >= STATUS_SUCCESS {
+				// End of a stream, good or bad
+				self.metrics.send_ns = self.bus_free - self.send_start;
+				self.metrics.bus_ns = self.bus_ns;
+				self.metrics.cpu_ns = self.loader.cpu_ns;
+			}
+			self.rx.push_back((self.bus_free, frame));
+		}
+	}
+}
+
+impl Bus for SimBus {
+	fn write(&mut self, id: u32, data: &[u8]) -> i16 {
+		if self.host.0 <= 0 {
+			return ERR_PARAM;
+		}
+		let start = max(self.now, self.bus_free);
+		let data_id = self.loader.data_id;
+		if id == data_id && data.len() > 2 && data[0] == 0 && data[1] == 1 {
+			// First frame of a stream
+			self.send_start = start;
+			self.bus_ns = 0;
+			self.loader.cpu_ns = 0;
+		}
+		self.collect(start);
+
+		let mut faults = Vec::new();
+		if id == data_id && data.len() > 2 && (data[0] != 0 || data[1] != 0) {
+			self.data_frames += 1;
+			let frame = self.data_frames;
+			faults = self.loader.config.faults.iter().filter(|f| f.hits(frame)).map(|f| f.fault).collect();
+		}
+		if faults.contains(&Fault::BusOff) {
+			// TEC past 255. canWriteWait() fails and the controller sits out the recovery.
+			self.errors.0 += 1;
+			self.bus_off_until = start + BUS_OFF_BITS * self.bit_ns();
+		}
+		if start < self.bus_off_until {
+			self.now = self.bus_off_until;
+			self.bus_free = self.now;
+			return ERR_TIMEOUT;
+		}
+
+		if !self.hears() {
+			// No one acknowledges, the controller retries until canWriteWait() gives up
+			self.errors.0 += 1;
+			self.now = start + WRITE_TIMEOUT_NS;
+			self.bus_ns += WRITE_TIMEOUT_NS;
+			self.busy_ns += WRITE_TIMEOUT_NS;
+			self.bus_free = self.now;
+			return ERR_TIMEOUT;
+		}
+
+		// A frame hit by a bus error is cut short by an error frame and sent again
+		let frame_ns = self.frame_ns(data.len());
+		let mut busy = frame_ns;
+		let mut bit_errors = if faults.contains(&Fault::BitError) { 1 } else { 0 };
+		while self.loader.config.loss > 0.0 && self.chance() < self.loader.config.loss {
+			bit_errors += 1;
+		}
+		busy += bit_errors * (frame_ns / 2 + ERROR_FRAME_BITS * self.bit_ns());
+		self.errors.0 += bit_errors as u32;
+		// The loader's receive error counter, +8 for each error frame it
+		// flags and -1 for the frame that gets through
+		self.loader.rec = (self.loader.rec + 8 * bit_errors as u32).saturating_sub(1);
+		self.bus_free = start + busy;
+		self.bus_ns += busy;
+		self.busy_ns += busy;
+		self.now = self.bus_free + WRITE_LATENCY_NS;
+
+		let end = self.bus_free;
+		self.loader.advance(end);
+		if faults.contains(&Fault::Reorder) {
+			let mut frame = [0u8; 8];
+			frame[..data.len()].copy_from_slice(data);
+			self.held = Some((frame, data.len()));
+			return 0;
+		}
+		if !faults.contains(&Fault::Drop) {
+			self.loader.receive(end, id, data);
+		}
+		if faults.contains(&Fault::Duplicate) {
+			self.loader.receive(end, id, data);
+		}
+		if let Some((frame, dlc)) = self.held.take() {
+			self.loader.receive(end, id, &frame[..dlc]);
+		}
+		0
+	}
+
+	fn pause(&mut self, us: u32) {
+		self.now += us as u64 * 1000;
+	}
+
+	fn read(&mut self, timeout: u32) -> Result<Frame, i16> {
+		let deadline = self.now + if timeout == NO_TIMEOUT { LONGEST_WAIT_NS } else { timeout as u64 * 1000000 };
+		let now = self.now;
+		self.collect(now);
+		loop {
+			if let Some((at, frame)) = self.rx.pop_front() {
+				self.now = max(self.now, at);
+				return Ok(frame);
+			}
+			if self.now >= deadline {
+				return Err(ERR_NOMSG);
+			}
+			let step = ::std::cmp::min(deadline, self.now + READ_STEP_NS);
+			self.collect(step);
+			if self.rx.is_empty() {
+				self.now = step;
+			}
+		}
+	}
+
+	fn flush(&mut self) {
+		let now = self.now;
+		self.collect(now);
+		self.rx.clear();
+	}
+
+	fn set_params(&mut self, freq: i32, tseg1: u32, tseg2: u32, _sjw: u32) -> i16 {
+		let rate = match bus::bitrate(freq) {
+			Some(rate) => rate as i32,
+			None => return ERR_PARAM,
+		};
+		self.host = (rate, tseg1, tseg2);
+		0
+	}
+
+	fn error_counters(&mut self) -> (u32, u32, u32) {
+		(self.errors.0, self.errors.1, 0)
+	}
+
+	fn clock(&mut self) -> u64 {
+		self.now / 1000
+	}
+
+	fn bus_load(&mut self) -> Option<f64> {
+		let now = self.now;
+		self.collect(now);
+		let (since, busy) = self.load_from;
+		self.load_from = (now, self.busy_ns);
+		if now == since {
+			return None;
+		}
+		Some((self.busy_ns - busy) as f64 / (now - since) as f64)
+	}
+}
+
+#[cfg(test)]
+mod tests {
+	use super::*;
+	use std::env;
+	use std::fs;
+	use std::process;
+	use dump;
+	use image::Image;
+
+	const DEVICE: u32 = 0x100;
+
+	// Fresh loader that has just been sent the start command
+	fn started(version: u8, modes: u8) -> SimBus {
+		let mut sim = SimBus::new(Config {
+			device: DEVICE,
+			version: version,
+			modes: modes,
+			ring_frames: 63,
+			profile: PROFILE_DEFAULT,
+			flash: &FLASH_TYPICAL,
+			loss: 0.0,
+			seed: 1,
+			faults: Vec::new(),
+		});
+		sim.set_params(DEVICE_BITRATE, 0, 0, 0);
+		sim.write(DEVICE, &[0xFF; 8]);
+		sim
+	}
+
+	// The first frame a host from before the hello would take for the
+	// heartbeat: anything on REPLY_ID
+	fn first_reply(sim: &mut SimBus) -> (u16, u64) {
+		loop {
+			let frame = sim.read(NO_TIMEOUT).unwrap();
+			if frame.id == REPLY_ID as i32 {
+				let status = ((frame.data[2] as u16) << 8) | frame.data[3] as u16;
+				return (status, sim.now());
+			}
+		}
+	}
+
+	#[test]
+	fn hello_is_not_on_the_reply_id() {
+		let (status, at) = first_reply(&mut started(4, MODE_COMMANDS | MODE_WINDOW));
+		assert_eq!(status, STATUS_HEARTBEAT);
+		// After the whole slot is erased
+		assert!(at >= BOOT_NS + HELLO_NS + 3 * FLASH_TYPICAL.erase_ns);
+	}
+
+	#[test]
+	fn dump_reads_up_to_the_end_of_the_slot() {
+		let mut sim = started(7, MODE_COMMANDS | MODE_READ);
+		first_reply(&mut sim);
+
+		// Seven words that end on the last word of the slots, so READs
+		// from the first one would run past it
+		let base = image::SLOT_RANGES[0].0;
+		let (start, end) = image::SLOT_RANGES[1];
+		let words: Vec<u16> = (1..8).collect();
+		let first = end + 1 - words.len() as u32;
+		let header = [0xAAAA, image::crc16_ccitt(&words), first as u16, (first >> 16) as u16,
+			words.len() as u16, 0, 0, 0, first as u16, (first >> 16) as u16];
+		let offset = (start - base) as usize;
+		sim.loader.flash[offset..offset + header.len()].copy_from_slice(&header);
+		let offset = (first - base) as usize;
+		sim.loader.flash[offset..offset + words.len()].copy_from_slice(&words);
+
+		let path = env::temp_dir().join(format!("dump-test-{}.a00", process::id()));
+		let path = path.to_str().unwrap();
+		let mut errors = 0;
+		assert_eq!(dump::backup(&mut sim, start, path, &mut errors), Ok(words.len()));
+		let saved = Image::load(path).unwrap();
+		fs::remove_file(path).unwrap();
+		assert_eq!(saved.blocks.len(), 1);
+		assert_eq!((saved.blocks[0].addr, &saved.blocks[0].data), (first, &words));
+	}
+}
@@ -82,13 +82,17 @@ MEMORY
 PAGE 0 :
    /* BEGIN is used for the "boot to SARAM" bootloader mode   */
     INIT_BOOT   : origin = 0x3D7800, length = 0x000020
-	CANBOOTINIT : origin = 0x3D7820, length = 0x0001d1
-	CANBOOT     : origin = 0x3D79F1, length = 0x00020d
+	CANBOOTINIT : origin = 0x3D7820, length = 0x0003de     /* Rest of OTP up to the key, boot-critical code only */
 	OTP_KEY		: origin = 0x3D7BFE, length = 0x000001
+	/* The loader proper lives in flash sector B, which the loader never erases */
+	CANBOOT     : origin = 0x3F4000, length = 0x001FFF
+	LOADER_KEY  : origin = 0x3F5FFF, length = 0x000001     /* LOADER_KEY_ADDR in CAN_Boot.c */
 	OTP_BMODE	: origin = 0x3D7BFF, length = 0x000001
 	BEGIN      : origin = 0x000000, length = 0x000002
 	RAMM0      : origin = 0x000050, length = 0x0003B0
+	RAMM1      : origin = 0x000480, length = 0x000378     /* on-chip RAM block M1 */
 	RAML0L1    : origin = 0x008000, length = 0x000C00
+	RAML3      : origin = 0x009000, length = 0x000800     /* Lower L3, runs the loader */
 	RESET      : origin = 0x3FFFC0, length = 0x000002
 	IQTABLES   : origin = 0x3FE000, length = 0x000B50     /* IQ Math Tables in Boot ROM */
 	IQTABLES2  : origin = 0x3FEB50, length = 0x00008C     /* IQ Math Tables in Boot ROM */
@@ -99,12 +103,9 @@ PAGE 0 :
 PAGE 1 :
 
    BOOT_RSVD   : origin = 0x000002, length = 0x00004E     /* Part of M0, BOOT rom will use this for stack */
-   RAMM1       : origin = 0x000480, length = 0x00037C     /* on-chip RAM block M1 */
-   BOOT_PASS   : origin = 0x0007fc, length = 0x000004
+   BOOT_PASS   : origin = 0x0007f8, length = 0x000008     /* Application handoff and boot key, see BootHandoff.h */
    RAML2       : origin = 0x008C00, length = 0x000400
-   RAML30		: origin = 0x009000, length = 0x000020
-   RAML31       : origin = 0x009020, length = 0x0001d1
-   RAML32		: origin = 0x0091f1, length = 0x00020d
+   BOOT_DATA	: origin = 0x009800, length = 0x000800     /* Bootloader tables and buffers (upper L3) */
 }
 
 
@@ -116,14 +117,22 @@ SECTIONS
 	BootPass		: > BOOT_PASS,	PAGE = 1
 	KeyVal			: > OTP_KEY, 	PAGE = 0
 	BootMode		: > OTP_BMODE,	PAGE = 0
+	LoaderKey		: > LOADER_KEY,	PAGE = 0
+	BootData		: > BOOT_DATA,	PAGE = 1
    .InitBoot    	: > INIT_BOOT,   PAGE = 0
-   //.InitBoot		: > RAML30,		PAGE = 1
    .OTP_INIT		: > CANBOOTINIT, PAGE = 0
-   //.OTP_INIT		: > RAML31,		PAGE = 1
-   .OTP		  		: > CANBOOT,   PAGE = 0
-   //.OTP				: >	RAML32,		PAGE = 1
+   /* Loaded in sector B, copied to RAM by CopyToRam() in CAN_Boot() */
+   .LOADER	  		: LOAD = CANBOOT,   PAGE = 0
+   					  RUN = RAML3,      PAGE = 0
+   					  LOAD_START(_LoaderLoadStart),
+   					  LOAD_SIZE(_LoaderLoadSize),
+   					  RUN_START(_LoaderRunStart)
    codestart        : > BEGIN,     PAGE = 0
-   ramfuncs         : > RAMM0      PAGE = 0
+   ramfuncs         : LOAD = CANBOOTINIT, PAGE = 0
+   					  RUN = RAMM0,      PAGE = 0
+   					  LOAD_START(_RamfuncsLoadStart),
+   					  LOAD_SIZE(_RamfuncsLoadSize),
+   					  RUN_START(_RamfuncsRunStart)
    .text            : > RAML0L1,   PAGE = 0
    .cinit           : > RAMM0,     PAGE = 0
    .pinit           : > RAMM0,     PAGE = 0
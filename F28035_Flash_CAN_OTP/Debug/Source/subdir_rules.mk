@@ -3,6 +3,13 @@
 ################################################################################
 
 # Each subdirectory must supply rules for building sources it contributes
+Source/BootHandoff.obj: ../Source/BootHandoff.c $(GEN_OPTS) $(GEN_HDRS)
+	@echo 'Building file: $<'
+	@echo 'Invoking: C2000 Compiler'
+	"C:/ti/ccsv6/tools/compiler/ti-cgt-c2000_6.4.6/bin/cl2000" -v28 -ml -mt --cla_support=cla0 --include_path="C:/ti/ccsv6/tools/compiler/ti-cgt-c2000_6.4.6/include" --include_path="C:/Users/Sean/Documents/Buckeye Current New/CAN-Bootloader/F28035_Flash_CAN_OTP/Headers" --include_path="C:/ti/controlSUITE/device_support/f2803x/v130/DSP2803x_headers/include" -g --diag_warning=225 --display_error_number --diag_wrap=off --preproc_with_compile --preproc_dependency="Source/BootHandoff.pp" --obj_directory="Source" $(GEN_OPTS__FLAG) "$<"
+	@echo 'Finished building: $<'
+	@echo ' '
+
 Source/CAN_Boot.obj: ../Source/CAN_Boot.c $(GEN_OPTS) $(GEN_HDRS)
 	@echo 'Building file: $<'
 	@echo 'Invoking: C2000 Compiler'
@@ -10,6 +17,13 @@ Source/CAN_Boot.obj: ../Source/CAN_Boot.c $(GEN_OPTS) $(GEN_HDRS)
 	@echo 'Finished building: $<'
 	@echo ' '
 
+Source/CopyToRam.obj: ../Source/CopyToRam.asm $(GEN_OPTS) $(GEN_HDRS)
+	@echo 'Building file: $<'
+	@echo 'Invoking: C2000 Compiler'
+	"C:/ti/ccsv6/tools/compiler/ti-cgt-c2000_6.4.6/bin/cl2000" -v28 -ml -mt --cla_support=cla0 --include_path="C:/ti/ccsv6/tools/compiler/ti-cgt-c2000_6.4.6/include" --include_path="C:/Users/Sean/Documents/Buckeye Current New/CAN-Bootloader/F28035_Flash_CAN_OTP/Headers" --include_path="C:/ti/controlSUITE/device_support/f2803x/v130/DSP2803x_headers/include" -g --diag_warning=225 --display_error_number --diag_wrap=off --preproc_with_compile --preproc_dependency="Source/CopyToRam.pp" --obj_directory="Source" $(GEN_OPTS__FLAG) "$<"
+	@echo 'Finished building: $<'
+	@echo ' '
+
 Source/DSP2803x_GlobalVariableDefs.obj: ../Source/DSP2803x_GlobalVariableDefs.c $(GEN_OPTS) $(GEN_HDRS)
 	@echo 'Building file: $<'
 	@echo 'Invoking: C2000 Compiler'
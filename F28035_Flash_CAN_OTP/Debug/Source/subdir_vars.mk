@@ -4,10 +4,12 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 ASM_SRCS += \
+../Source/CopyToRam.asm \
 ../Source/DSP2803x_usDelay.asm \
 ../Source/Init_Boot.asm 
 
 C_SRCS += \
+../Source/BootHandoff.c \
 ../Source/CAN_Boot.c \
 ../Source/DSP2803x_GlobalVariableDefs.c \
 ../Source/DSP2803x_SysCtrl.c \
@@ -15,7 +17,9 @@ C_SRCS += \
 ../Source/main.c 
 
 OBJS += \
+./Source/BootHandoff.obj \
 ./Source/CAN_Boot.obj \
+./Source/CopyToRam.obj \
 ./Source/DSP2803x_GlobalVariableDefs.obj \
 ./Source/DSP2803x_SysCtrl.obj \
 ./Source/DSP2803x_usDelay.obj \
@@ -24,10 +28,12 @@ OBJS += \
 ./Source/main.obj 
 
 ASM_DEPS += \
+./Source/CopyToRam.pp \
 ./Source/DSP2803x_usDelay.pp \
 ./Source/Init_Boot.pp 
 
 C_DEPS += \
+./Source/BootHandoff.pp \
 ./Source/CAN_Boot.pp \
 ./Source/DSP2803x_GlobalVariableDefs.pp \
 ./Source/DSP2803x_SysCtrl.pp \
@@ -35,6 +41,7 @@ C_DEPS += \
 ./Source/main.pp 
 
 C_DEPS__QUOTED += \
+"Source\BootHandoff.pp" \
 "Source\CAN_Boot.pp" \
 "Source\DSP2803x_GlobalVariableDefs.pp" \
 "Source\DSP2803x_SysCtrl.pp" \
@@ -42,7 +49,9 @@ C_DEPS__QUOTED += \
 "Source\main.pp" 
 
 OBJS__QUOTED += \
+"Source\BootHandoff.obj" \
 "Source\CAN_Boot.obj" \
+"Source\CopyToRam.obj" \
 "Source\DSP2803x_GlobalVariableDefs.obj" \
 "Source\DSP2803x_SysCtrl.obj" \
 "Source\DSP2803x_usDelay.obj" \
@@ -51,10 +60,12 @@ OBJS__QUOTED += \
 "Source\main.obj" 
 
 ASM_DEPS__QUOTED += \
+"Source\CopyToRam.pp" \
 "Source\DSP2803x_usDelay.pp" \
 "Source\Init_Boot.pp" 
 
 C_SRCS__QUOTED += \
+"../Source/BootHandoff.c" \
 "../Source/CAN_Boot.c" \
 "../Source/DSP2803x_GlobalVariableDefs.c" \
 "../Source/DSP2803x_SysCtrl.c" \
@@ -62,6 +73,7 @@ C_SRCS__QUOTED += \
 "../Source/main.c" 
 
 ASM_SRCS__QUOTED += \
+"../Source/CopyToRam.asm" \
 "../Source/DSP2803x_usDelay.asm" \
 "../Source/Init_Boot.asm" 
 
@@ -0,0 +1,86 @@
+//###########################################################################
+//
+// FILE:   BootHandoff.h
+//
+// TITLE:  Application to CAN bootloader handoff definitions.
+//
+// An application enters the bootloader by writing the boot key to the
+// BOOT_PASS area at the top of M1 and branching to the OTP boot entry. The
+// four words below the key describe clock and eCAN-A state the application
+// has already set up, so the loader can skip re-initializing it.
+//
+//###########################################################################
+
+#ifndef BOOT_HANDOFF_H
+#define BOOT_HANDOFF_H
+
+#include "DSP2803x_Device.h"
+
+//---------------------------------------------------------------------------
+// BOOT_PASS layout (0x7F8 - 0x7FF)
+//
+#define BOOT_HANDOFF_ADDR	(0x7F8)
+#define BOOT_MODE_ADDR		(0x7FC)
+#define BOOT_KEY_WORD1		(0x4142)
+#define BOOT_KEY_WORD2		(0x4B53)
+#define BOOT_KEY_WORD3		(0x5543)
+#define BOOT_KEY_WORD4		(0x4B53)
+
+// Flags word: the upper byte must hold the magic value for the rest of the
+// handoff to be trusted
+#define BOOT_HANDOFF_MAGIC	(0xB700)
+#define BOOT_HANDOFF_MASK	(0xFF00)
+#define BOOT_HANDOFF_CLOCK	(0x0001)	// PLL is locked, see PllConfig
+#define BOOT_HANDOFF_CAN	(0x0002)	// eCAN-A is running, see CanBtc
+#define BOOT_HANDOFF_PROFILE	(0x0004)	// Bits 6:4 select the bootload profile
+#define BOOT_HANDOFF_PROFILE_SHIFT	(4)
+#define BOOT_HANDOFF_RAM	(0x0008)	// Load the image to SARAM and run it there
+
+// Bootload bit timing profiles at SYSCLKOUT = 60 MHz. Bits 1:0 select the
+// bit rate and bit 2 moves the sample point from 80% to 87% of the bit time.
+// The loader falls back to the profile it started in if the host goes quiet
+// after a switch. Profiles and RAM load requests survive a failed bootload,
+// the rest of the handoff does not.
+#define BOOT_PROFILE_1M		(0)
+#define BOOT_PROFILE_500K	(1)
+#define BOOT_PROFILE_250K	(2)
+#define BOOT_PROFILE_125K	(3)
+#define BOOT_PROFILE_SP87	(4)
+#define BOOT_PROFILE_MAX	(7)
+#define BOOT_PROFILE_DEFAULT	(BOOT_PROFILE_1M)
+
+struct BOOT_HANDOFF {
+	Uint16 Flags;
+	Uint16 PllConfig;	// (PLLSTS.DIVSEL << 8) | PLLCR.DIV
+	Uint32 CanBtc;		// CANBTC of eCAN-A
+};
+
+#define BootHandoff (*(volatile struct BOOT_HANDOFF *) BOOT_HANDOFF_ADDR)
+
+//---------------------------------------------------------------------------
+// Application side API
+//
+// Boot_EnterLoader() does not return. Interrupts are disabled and the
+// loader is entered directly, without a reset, so clock and eCAN-A state
+// are still valid when it checks them. Since no reset stops the
+// application's outputs either, every pin but GPIO30/31 is first made a
+// GPIO input again and the clocks of all peripherals except eCAN-A and the
+// CPU timers are turned off. Boards must hold their power stage off through
+// pull resistors, as they have to after a reset anyway.
+//
+// Boot_EnterLoaderProfile() also tells the loader which bit timing profile
+// to start in, for harnesses that can't run the default 1 Mbit/s.
+//
+// Boot_EnterLoaderRam() asks for a development image linked for L0/L1
+// SARAM. The loader leaves flash alone and runs the image once loaded; the
+// next reset boots the flash application again. Call it when the start
+// command's last byte is BOOT_START_RAM (CAN_Bootloader -ram) instead of
+// 0xFF.
+//
+#define BOOT_START_RAM		(0x5A)
+
+extern void Boot_EnterLoader(void);
+extern void Boot_EnterLoaderProfile(Uint16 profile);
+extern void Boot_EnterLoaderRam(Uint16 profile);
+
+#endif  // end of BOOT_HANDOFF_H definition
@@ -0,0 +1,152 @@
+//###########################################################################
+//
+// FILE:    BootHandoff.c
+//
+// TITLE:   Application side of the CAN bootloader handoff
+//
+// Functions:
+//
+//     void Boot_EnterLoader(void)
+//     void Boot_EnterLoaderProfile(Uint16 profile)
+//     void Boot_EnterLoaderRam(Uint16 profile)
+//
+// Notes:
+// Link this file into the application. The OTP project builds it too, for
+// the main() that enters the loader when the project is run from the
+// debugger. It goes to .text in SARAM there and is not part of the OTP
+// image.
+//###########################################################################
+
+#include "DSP2803x_Device.h"
+#include "Boot.h"
+#include "BootHandoff.h"
+
+static void Boot_Enter(Uint16 profile, Uint16 flags);
+static void Boot_SafeState(void);
+
+//#################################################
+// void Boot_EnterLoader(void)
+//-----------------------------------------------
+// Enter the loader in the default bit timing
+// profile.
+//-----------------------------------------------
+
+void Boot_EnterLoader(void)
+{
+	Boot_EnterLoaderProfile(BOOT_PROFILE_DEFAULT);
+}
+
+//#################################################
+// void Boot_EnterLoaderProfile(Uint16 profile)
+//-----------------------------------------------
+// Describe the clock and eCAN-A state the loader
+// can reuse, put the pins and peripherals in their
+// reset state (see Boot_SafeState()), write the
+// boot key and branch to the OTP boot entry point.
+// The loader talks to the host in the given
+// BOOT_PROFILE_x bit timing.
+//-----------------------------------------------
+
+void Boot_EnterLoaderProfile(Uint16 profile)
+{
+	Boot_Enter(profile, 0);
+}
+
+//#################################################
+// void Boot_EnterLoaderRam(Uint16 profile)
+//-----------------------------------------------
+// Like Boot_EnterLoaderProfile(), for an image
+// that is loaded to SARAM and run from there.
+//-----------------------------------------------
+
+void Boot_EnterLoaderRam(Uint16 profile)
+{
+	Boot_Enter(profile, BOOT_HANDOFF_RAM);
+}
+
+//#################################################
+// static void Boot_Enter(Uint16 profile, Uint16 flags)
+//-----------------------------------------------
+// Common part of the entry functions. flags are
+// BOOT_HANDOFF_x requests passed on as they are.
+//-----------------------------------------------
+
+static void Boot_Enter(Uint16 profile, Uint16 flags)
+{
+	Uint16 * modeAddr = (Uint16 *) BOOT_MODE_ADDR;
+
+	flags |= BOOT_HANDOFF_MAGIC;
+	DINT;
+
+	if (profile != BOOT_PROFILE_DEFAULT)
+	{
+		flags |= BOOT_HANDOFF_PROFILE | ((profile & BOOT_PROFILE_MAX) << BOOT_HANDOFF_PROFILE_SHIFT);
+	}
+
+	if ((SysCtrlRegs.PLLSTS.bit.PLLLOCKS == 1) && (SysCtrlRegs.PLLSTS.bit.MCLKSTS == 0))
+	{
+		flags |= BOOT_HANDOFF_CLOCK;
+		BootHandoff.PllConfig = (SysCtrlRegs.PLLSTS.bit.DIVSEL << 8) | SysCtrlRegs.PLLCR.bit.DIV;
+	}
+
+	// The bit timing is only reusable if the module is clocked and has left
+	// configuration mode
+	if ((SysCtrlRegs.PCLKCR0.bit.ECANAENCLK == 1) && (ECanaRegs.CANES.bit.CCE == 0))
+	{
+		flags |= BOOT_HANDOFF_CAN;
+		BootHandoff.CanBtc = ECanaRegs.CANBTC.all;
+	}
+	BootHandoff.Flags = flags;
+	Boot_SafeState();
+
+	*modeAddr++ = BOOT_KEY_WORD1;
+	*modeAddr++ = BOOT_KEY_WORD2;
+	*modeAddr++ = BOOT_KEY_WORD3;
+	*modeAddr++ = BOOT_KEY_WORD4;
+
+	asm("   LB 0x3D7800");		// OTP_ENTRY_POINT
+	while(1);
+}
+
+//#################################################
+// static void Boot_SafeState(void)
+//-----------------------------------------------
+// There is no reset on the way into the loader,
+// so nothing else would stop the application's
+// outputs. Every pin except the eCAN-A pair goes
+// back to a GPIO input with its reset pull-up
+// setting, which leaves the outputs to the board's
+// pull resistors as after a reset. Then the clocks
+// of every peripheral the loader does not use are
+// turned off, which stops the PWM time bases, the
+// ADC, the serial ports and the CLA. eCAN-A and the
+// CPU timers keep running.
+//-----------------------------------------------
+
+static void Boot_SafeState(void)
+{
+	EALLOW;
+	GpioCtrlRegs.GPADIR.all = 0;
+	GpioCtrlRegs.GPBDIR.all = 0;
+	GpioCtrlRegs.AIODIR.all = 0;
+	GpioCtrlRegs.GPAMUX1.all = 0;
+	GpioCtrlRegs.GPAMUX2.all &= 0xF0000000;		// GPIO30 and GPIO31 may be CANRXA/CANTXA
+	GpioCtrlRegs.GPBMUX1.all = 0;
+	GpioCtrlRegs.GPAPUD.all = 0x00000FFF;		// Reset value, ePWM pins without pull-up
+	GpioCtrlRegs.GPBPUD.all = 0;
+
+	SysCtrlRegs.PCLKCR0.bit.TBCLKSYNC = 0;
+	SysCtrlRegs.PCLKCR0.bit.HRPWMENCLK = 0;
+	SysCtrlRegs.PCLKCR0.bit.ADCENCLK = 0;
+	SysCtrlRegs.PCLKCR0.bit.I2CAENCLK = 0;
+	SysCtrlRegs.PCLKCR0.bit.SPIAENCLK = 0;
+	SysCtrlRegs.PCLKCR0.bit.SPIBENCLK = 0;
+	SysCtrlRegs.PCLKCR0.bit.SCIAENCLK = 0;
+	SysCtrlRegs.PCLKCR0.bit.LINAENCLK = 0;
+	SysCtrlRegs.PCLKCR1.all = 0;				// ePWM1-7, eCAP1, eQEP1
+	SysCtrlRegs.PCLKCR3.bit.COMP1ENCLK = 0;
+	SysCtrlRegs.PCLKCR3.bit.COMP2ENCLK = 0;
+	SysCtrlRegs.PCLKCR3.bit.COMP3ENCLK = 0;
+	SysCtrlRegs.PCLKCR3.bit.CLA1ENCLK = 0;
+	EDIS;
+}
@@ -9,10 +9,29 @@
 // Functions:
 //
 //     Uint32 CAN_Boot(void)
-//     void CAN_Init(void)
+//     Uint32 Loader_Start(Uint16 slot, Uint16 profile, Uint16 keepBitTiming)
+//     void CAN_Init(Uint16 profile, Uint16 keepBitTiming)
+//     void CAN_SetBitTiming(Uint16 profile)
+//     void CAN_SendReply(Uint32 mdl, Uint32 mdh)
+//     Uint16 Clock_IsConfigured(void)
 //     Uint32 CAN_GetWordData(void)
+//     void CRC16_Init(void)
+//     Uint16 CRC16_Calc(Uint16 crc, Uint16 * addr, Uint32 length)
+//     Uint16 App_IsValid(Uint16 slot)
+//     Uint16 App_SelectSlot(void)
+//     Uint16 Slot_EraseTo(Uint16 slot, Uint32 end, Uint16 * erased)
+//     Uint16 CAN_RxHealth(Uint16 * lostSeen)
+//     Uint32 CAN_RxBench(Uint16 batches)
+//     interrupt void CAN_RxIsr(void)
 //
 // Notes:
+// The OTP only holds what every reset runs: clock and flash setup, the
+// application slot check and the jump to the application (.OTP_INIT and
+// the load image of ramfuncs). The loader proper, from Loader_Start() on,
+// is linked into flash sector B (.LOADER) and copied to L3 SARAM only when
+// a bootload is requested. The loader never erases sector B, and CAN_Boot()
+// only runs it once LOADER_KEY is found behind it.
+//
 // BRP = 2, Bit time = 10. This would yield the following bit rates with the
 // default PLL setting:
 // XCLKIN = 40 MHz	SYSCLKOUT = 20 MHz	Bit rate = 1 Mbits/s
@@ -25,33 +44,174 @@
 //###########################################################################
 
 #include "DSP2803x_Device.h"
+#include "DSP2803x_Examples.h"
 #include "Boot.h"
+#include "BootHandoff.h"
 
 /*---- Flash API include file -------------------------------------------------*/
 #include "Flash2803x_API_Library.h"
 
-#define BOOT_MODE_ADDR	(0x7FC)
-#define BOOT_KEY_WORD1	(0x4142)
-#define BOOT_KEY_WORD2	(0x4B53)
-#define BOOT_KEY_WORD3	(0x5543)
-#define BOOT_KEY_WORD4	(0x4B53)
-#define FLASH_STAT_ADDR	(0x3F6000)
 #define FLASH_SUCCESS	(0xAAAA)
 
-#define DELAY_US(A)  DSP28x_usDelay(((((long double) A * 1000.0L) / (long double)CPU_RATE) - 9.0L) / 5.0L)
-
-#define RAM_START		((Uint16*)0x00000480)
-#define OTP_END			((Uint16*)0x3D7BFD)
-//#define OTP_END			((Uint16*)0x93FD)
-
-#define LOAD_ADDRESS_ON_FAIL	(0x3D7820)
+// Application slots. Flash is split into two slots of three sectors each,
+// slot 0 in sectors H-F and slot 1 in sectors E-C. An image is linked for
+// the slot it will run from, and the loader only ever writes the slot that
+// is not currently selected so the running application survives a failed
+// update. Sectors B and A are not touched by the loader.
+#define APP_SLOT_COUNT	(2)
+#define APP_NO_SLOT		(0xFFFF)
+#define SLOT_START(s)	((s) ? 0x3EE000UL : 0x3E8000UL)
+#define SLOT_END(s)		((s) ? 0x3F3FFFUL : 0x3EDFFFUL)
+#define SLOT_SECTORS(s)	((s) ? (SECTORE|SECTORD|SECTORC) : (SECTORH|SECTORG|SECTORF))
+
+// Flash API SECTORx mask of the 8K word sector holding address a. Sector A
+// is the top one, sector H starts at 0x3E8000.
+#define SECTOR_BIT(a)	((Uint16) 1 << (Uint16) ((0x3F7FFFUL - (a)) >> 13))
+#define SECTOR_A_START	(0x3F6000UL)
+#define SECTOR_WORDS	(0x2000UL)
+
+// Flash that BOOT_CMD_READ may read: both slots, sectors H to C. Sector B
+// holds the loader and sector A the code security passwords.
+#define READ_START		(SLOT_START(0))
+#define READ_END		(SLOT_END(1))
+
+// Each slot starts with an application header. The status word is programmed
+// last, after the CRC, span, sequence and entry point of the image have been
+// written, so an interrupted update never selects the slot.
+#define APP_HEADER_SIZE	(16)		// Words reserved for the header
+#define APP_HEADER(s)	((struct APP_HEADER *) SLOT_START(s))
+
+// Last word of sector B, programmed with the loader image (LoaderKey)
+#define LOADER_KEY_ADDR	(0x3F5FFFUL)
+#define LOADER_KEY		(0x4C44)
+
+// RAM loads (BOOT_HANDOFF_RAM) go to L0 and L1 SARAM instead of a slot and
+// run from there, with no header and no flash erased or written. L2 holds
+// the stack and L3 the loader and its buffers.
+#define BOOT_SLOT_RAM	(2)		// Slot reported in heartbeats
+#define RAM_LOAD_START	(0x008000UL)
+#define RAM_LOAD_END	(0x008BFFUL)
+
+#define CRC16_POLY		(0x1021)	// CRC-16/CCITT
+#define CRC16_INIT		(0xFFFF)
+
+// eCAN-A bit timing for a BOOT_PROFILE_x at SYSCLKOUT = 60 MHz. All profiles
+// use 15 time quanta per bit, the prescaler sets the rate (1 Mbit/s at BRP 2)
+// and the TSEG1/TSEG2 split sets the sample point.
+#define CAN_BRPREG(p)	((2 << ((p) & 3)) - 1)
+#define CAN_TSEG1REG(p)	(((p) & BOOT_PROFILE_SP87) ? 11 : 10)
+#define CAN_TSEG2REG(p)	(((p) & BOOT_PROFILE_SP87) ? 1 : 2)
+#define CAN_SJWREG		(1)
+#define CAN_SAM			(0)
+#define CAN_BTC(p)		(((Uint32) CAN_BRPREG(p) << 16) | (CAN_SJWREG << 8) | (CAN_SAM << 7) | \
+						 (CAN_TSEG1REG(p) << 3) | CAN_TSEG2REG(p))
+
+// Heartbeats without any traffic before a profile switch is undone
+#define PROFILE_REVERT_BEATS	(4)
+
+// Ring wait loop passes, about 50 ms, for a host to answer BOOT_STATUS_HELLO
+#define HELLO_WAIT				(400000)
+// MSGID of BOOT_STATUS_HELLO. Hosts from before the hello start the stream
+// on any frame on the reply MSGID 0x2, which must wait for the erase.
+#define BOOT_HELLO_ID			(0x3)
+
+// Heartbeat periods the stream may stall before the load fails. Each one
+// asks a windowed host for the next frame again.
+#define STREAM_STALL_BEATS		(4)
+
+// A failed load returns here through ExitBoot, which restarts the loader
+// with a fresh stack. The boot request is still set.
+#define LOAD_ADDRESS_ON_FAIL	(OTP_ENTRY_POINT)
+
+// Receive ring filled by CAN_RxIsr, in frames. Must be a power of two.
+#define CAN_RING_SIZE	(64)
+
+// Bootload() stream decoder states
+#define STREAM_HEADER	(0)		// Key, reserved words and entry point
+#define STREAM_SIZE		(1)		// Block size
+#define STREAM_ADDR		(2)		// Block DestAddr
+#define STREAM_DATA		(3)		// Block data
+#define STREAM_DONE		(4)
+
+// Status codes sent on the reply mailbox (MDL low word)
+#define BOOT_STATUS_HEARTBEAT		(0x0000)	// MDL high word holds the target slot
+#define BOOT_STATUS_ACK				(0x0001)	// MDL high word echoes the command
+#define BOOT_STATUS_WINDOW			(0x0002)	// MDH holds the frames programmed so far
+#define BOOT_STATUS_NACK			(0x0003)	// MDH holds the missing frame's position
+#define BOOT_STATUS_HELLO			(0x0004)	// As HEARTBEAT, before the slot is erased
+#define BOOT_STATUS_FAIL_CRC			(0xFFF9)	// MDH holds the CRC of what was written
+#define BOOT_STATUS_FAIL_COMMAND		(0xFFFA)	// Unknown command or bad argument
+#define BOOT_STATUS_SUCCESS			(0x8000)	// MDL high word holds the blank sectors not erased
+#define BOOT_STATUS_FAIL_SLOT		(0xFFFB)	// Block outside the target slot
+#define BOOT_STATUS_FAIL_PROGRAM		(0xFFFC)
+#define BOOT_STATUS_FAIL_KEY			(0xFFFD)
+#define BOOT_STATUS_FAIL_ERASE		(0xFFFE)
+#define BOOT_STATUS_FAIL_SEQUENCE	(0xFFFF)
+
+// Commands accepted before the boot stream starts, see the protocol notes
+// at the end of this file
+#define BOOT_CMD_PING				(0x01)
+#define BOOT_CMD_SET_PROFILE		(0x02)	// Argument: BOOT_PROFILE_x
+#define BOOT_CMD_SLOT_INFO			(0x03)	// Argument: slot
+#define BOOT_CMD_WINDOW				(0x04)	// Argument: frames per BOOT_STATUS_WINDOW, 0 for off
+#define BOOT_CMD_KEEP				(0x05)	// Argument: SECTORx mask to program without erasing
+#define BOOT_CMD_SLOT_CRC			(0x06)	// Argument: slot
+#define BOOT_CMD_READ				(0x07)	// Argument: frames of 4 words, MDH: address
+#define BOOT_CMD_SET_IDS			(0x08)	// MDH: (data MSGID << 16) | reply MSGID
+#define BOOT_CMD_SELF_TEST			(0x09)	// Argument: batches of CAN_RING_SIZE - 1 frames
+#define BOOT_CMD_EXPECT_CRC			(0x0A)	// MDH: CRC16 the image must have
+
+// Loader capabilities, sent in MDH of every heartbeat:
+// magic, version, BOOT_MODE_x mask, receive ring size in frames
+#define BOOT_LOADER_VERSION			(11)
+#define BOOT_CAPS_MAGIC				(0xCA)
+#define BOOT_MODE_COMMANDS			(0x01)	// Accepts BOOT_CMD_x before the stream
+#define BOOT_MODE_MULTIWORD			(0x02)	// Data frames carry up to 3 words
+#define BOOT_MODE_CRC				(0x04)	// Success reply carries the image CRC
+#define BOOT_MODE_WINDOW			(0x08)	// Accepts BOOT_CMD_WINDOW, sends NACKs
+#define BOOT_MODE_POSITION			(0x10)	// WINDOW and NACK carry 32 bit frame positions
+#define BOOT_MODE_KEEP				(0x20)	// Accepts BOOT_CMD_KEEP
+#define BOOT_MODE_SLOT_CRC			(0x40)	// Accepts BOOT_CMD_SLOT_CRC
+#define BOOT_MODE_READ				(0x80)	// Accepts BOOT_CMD_READ
+#define BOOT_MODES					(BOOT_MODE_COMMANDS | BOOT_MODE_MULTIWORD | BOOT_MODE_CRC | \
+									 BOOT_MODE_WINDOW | BOOT_MODE_POSITION | BOOT_MODE_KEEP | \
+									 BOOT_MODE_SLOT_CRC | BOOT_MODE_READ)
+#define BOOT_CAPS					(((Uint32) BOOT_CAPS_MAGIC << 24) | ((Uint32) BOOT_LOADER_VERSION << 16) | \
+									 (BOOT_MODES << 8) | (CAN_RING_SIZE - 1))
+
+struct CAN_FRAME {
+	Uint32 Mdl;
+	Uint32 Mdh;
+	Uint16 Dlc;
+};
+
+struct APP_HEADER {
+	Uint16 Status;		// FLASH_SUCCESS once the image is complete
+	Uint16 Crc;			// CRC16 of the flash span below
+	Uint32 StartAddr;	// First flash address written by the image
+	Uint32 Length;		// Words from StartAddr to the last word written
+	Uint32 Sequence;	// Higher than the other slot's when written
+	Uint32 EntryAddr;	// Entry point from the boot stream
+};
 
 // Private functions
 Uint32 CAN_Boot(void);
-void CAN_Init(void);
+Uint32 Loader_Start(Uint16 slot, Uint16 profile, Uint16 keepBitTiming);
+void CAN_Init(Uint16 profile, Uint16 keepBitTiming);
+void CAN_SetBitTiming(Uint16 profile);
+void CAN_SendReply(Uint32 mdl, Uint32 mdh);
+Uint16 Clock_IsConfigured(void);
 Uint16 CAN_GetWordData(void);
-void CopyToRam(Uint16 * ramAddr, Uint16 * otpAddr);
-Uint32 Bootload(void);
+void CopyToRam(Uint16 * runAddr, Uint16 * loadAddr, Uint16 words);
+Uint32 Bootload(Uint16 slot, Uint16 profile);
+interrupt void CAN_RxIsr(void);
+void CRC16_Init(void);
+Uint16 CRC16_Calc(Uint16 crc, Uint16 * addr, Uint32 length);
+Uint16 App_IsValid(Uint16 slot);
+Uint16 App_SelectSlot(void);
+Uint16 Slot_EraseTo(Uint16 slot, Uint32 end, Uint16 * erased);
+Uint16 CAN_RxHealth(Uint16 * lostSeen);
+Uint32 CAN_RxBench(Uint16 batches);
 
 // External functions
 /*
@@ -60,6 +220,18 @@ extern Uint32 GetLongData(void);
 extern void ReadReservedFn(void);
 */
 extern void InitSysCtrl();
+extern void EnableDog();
+extern void DisableDog();
+extern void InitPeripheralClocks();
+extern void InitFlash();
+
+// Load and run addresses of the RAM resident sections, from the linker
+extern Uint16 LoaderLoadStart;
+extern Uint16 LoaderLoadSize;
+extern Uint16 LoaderRunStart;
+extern Uint16 RamfuncsLoadStart;
+extern Uint16 RamfuncsLoadSize;
+extern Uint16 RamfuncsRunStart;
 
 
 // Reserve boot pass addresses
@@ -67,6 +239,10 @@ extern void InitSysCtrl();
 const Uint32 bootPass = 0x0;
 #pragma DATA_SECTION(bootPass2, "BootPass");
 const Uint32 bootPass2 = 0x0;
+#pragma DATA_SECTION(bootHandoff, "BootPass");
+const Uint32 bootHandoff = 0x0;
+#pragma DATA_SECTION(bootHandoff2, "BootPass");
+const Uint32 bootHandoff2 = 0x0;
 
 #pragma DATA_SECTION(bootKey, "KeyVal");
 const Uint16 bootKey = KEY_VAL;
@@ -74,6 +250,23 @@ const Uint16 bootKey = KEY_VAL;
 #pragma DATA_SECTION(bootMode, "BootMode");
 const Uint16 bootMode = OTP_BOOT;
 
+#pragma DATA_SECTION(loaderKey, "LoaderKey");
+const Uint16 loaderKey = LOADER_KEY;
+
+// Byte-wise CRC lookup table. It is generated into RAM at boot by
+// CRC16_Init() since there is no room for it in OTP.
+#pragma DATA_SECTION(crcTable, "BootData");
+Uint16 crcTable[256];
+
+#pragma DATA_SECTION(canRing, "BootData");
+volatile struct CAN_FRAME canRing[CAN_RING_SIZE];
+#pragma DATA_SECTION(canRingHead, "BootData");
+volatile Uint16 canRingHead;	// Written by CAN_RxIsr only
+#pragma DATA_SECTION(canRingTail, "BootData");
+volatile Uint16 canRingTail;	// Written by Bootload() only
+#pragma DATA_SECTION(canLost, "BootData");
+volatile Uint16 canLost;		// Frames dropped, written by CAN_RxIsr only
+
 //#################################################
 // Uint32 CAN_Boot(void)
 //--------------------------------------------
@@ -88,41 +281,104 @@ const Uint16 bootMode = OTP_BOOT;
 #pragma CODE_SECTION(CAN_Boot, ".OTP_INIT")
 Uint32 CAN_Boot()
 {
-	Uint16 *ramAddr = RAM_START;
-	Uint16 *otpAddr = (Uint16 *)&Bootload;
+	Uint16 * modeAddr = (Uint16 *) BOOT_MODE_ADDR;
+	Uint16 bootRequested = (modeAddr[0] == BOOT_KEY_WORD1) &&
+						   (modeAddr[1] == BOOT_KEY_WORD2) &&
+						   (modeAddr[2] == BOOT_KEY_WORD3) &&
+						   (modeAddr[3] == BOOT_KEY_WORD4);
+	Uint16 activeSlot;
+	Uint16 handoff = 0;
+	Uint16 profile = BOOT_PROFILE_DEFAULT;
+
+	// OTP comes out of reset at the slowest wait states. Set the flash and
+	// OTP wait states first, from RAM, so everything after runs faster.
+	CopyToRam(&RamfuncsRunStart, &RamfuncsLoadStart, (Uint16) &RamfuncsLoadSize);
+	InitFlash();
+
+	// An application entering the loader directly may have left the clock
+	// and eCAN-A running. Only trust that for this one entry. The bit timing
+	// profile is kept until a bootload completes, so a retry after a reset
+	// talks to the host at the same rate.
+	if ((BootHandoff.Flags & BOOT_HANDOFF_MASK) == BOOT_HANDOFF_MAGIC)
+	{
+		handoff = BootHandoff.Flags;
+	}
+	BootHandoff.Flags = handoff & ~(BOOT_HANDOFF_CLOCK | BOOT_HANDOFF_CAN);
+	if (bootRequested && (handoff & BOOT_HANDOFF_PROFILE))
+	{
+		profile = (handoff >> BOOT_HANDOFF_PROFILE_SHIFT) & BOOT_PROFILE_MAX;
+	}
 
-	if (*((Uint16 *) FLASH_STAT_ADDR) == FLASH_SUCCESS)
+	// The image check runs at full clock speed, so bring up the PLL first,
+	// unless it is already locked at the rate the loader runs at
+	if (bootRequested && (handoff & BOOT_HANDOFF_CLOCK) && Clock_IsConfigured())
 	{
-		Uint16 * modeAddr = (Uint16 *) BOOT_MODE_ADDR;
-		if (*modeAddr != BOOT_KEY_WORD1)
-		{
-		   return FLASH_ENTRY_POINT;
-		}
-		modeAddr++;
+		DisableDog();
+		InitPeripheralClocks();
+	}
+	else
+	{
+		InitSysCtrl();
+	}
+	CRC16_Init();
 
-		if (*modeAddr != BOOT_KEY_WORD2)
-		{
-		   return FLASH_ENTRY_POINT;
-		}
-		modeAddr++;
+	// Run the newest slot whose header and CRC check out. A partially
+	// programmed or corrupted image falls back to the other slot, and
+	// with no valid slot at all the node stays in bootload mode.
+	activeSlot = App_SelectSlot();
+	if (!bootRequested && (activeSlot != APP_NO_SLOT))
+	{
+		EnableDog();
+		return APP_HEADER(activeSlot)->EntryAddr;
+	}
 
-		if (*modeAddr != BOOT_KEY_WORD3)
+	// Without the loader in sector B there is nothing to bootload with.
+	// Keep running the application rather than stop the node, and drop
+	// the request so the next reset does not come back here.
+	if (*(volatile Uint16 *) LOADER_KEY_ADDR != LOADER_KEY)
+	{
+		modeAddr[0] = 0;
+		if (activeSlot != APP_NO_SLOT)
 		{
-		   return FLASH_ENTRY_POINT;
+			EnableDog();
+			return APP_HEADER(activeSlot)->EntryAddr;
 		}
-		modeAddr++;
+		for(;;);
+	}
 
-		if (*modeAddr != BOOT_KEY_WORD4)
-		{
-		   return FLASH_ENTRY_POINT;
-		}
+	// The loader and everything it calls while the flash API is active run
+	// from L3. Only the used length of .LOADER is copied.
+	CopyToRam(&LoaderRunStart, &LoaderLoadStart, (Uint16) &LoaderLoadSize);
+
+	// Write the slot that is not running. Like the profile, a RAM load
+	// request holds until a load completes.
+	if (bootRequested && (handoff & BOOT_HANDOFF_RAM))
+	{
+		activeSlot = BOOT_SLOT_RAM;
+	}
+	else
+	{
+		activeSlot = (activeSlot == 0) ? 1 : 0;
 	}
+	return Loader_Start(activeSlot, profile, bootRequested && (handoff & BOOT_HANDOFF_CAN));
+}
 
-	InitSysCtrl();
 
-	// Use RAMM1 (Starting address 0x400) for bootloading
-	CopyToRam(ramAddr, otpAddr);
+//#################################################
+// Uint32 Loader_Start(Uint16 slot, Uint16 profile, Uint16 keepBitTiming)
+//--------------------------------------------
+// Entry to the loader in RAM. Sets up eCAN-A in
+// the given bit timing profile and its receive
+// interrupt, bootloads the slot and returns the
+// entry point of the new image, or
+// LOAD_ADDRESS_ON_FAIL. keepBitTiming is passed
+// on to CAN_Init().
+//--------------------------------------------
 
+#pragma CODE_SECTION(Loader_Start, ".LOADER")
+Uint32 Loader_Start(Uint16 slot, Uint16 profile, Uint16 keepBitTiming)
+{
+   Uint32 returnAddr;
 
    EALLOW;
    SysCtrlRegs.WDCR = 0x0068;	// Disable watchdog module
@@ -134,29 +390,64 @@ Uint32 CAN_Boot()
       for(;;);
    }
 
-   CAN_Init();
-
-   // Point to the bootload function now in RAM
-   Uint32 (*bootload)(void) = (RAM_START);
-   // Jump to bootload
-   Uint32 returnAddr = (*bootload)();
-   if (returnAddr == LOAD_ADDRESS_ON_FAIL)
-   {
-	   asm("   B #0xFFFFFFAF, UNC");
-   }
+   CAN_Init(profile, keepBitTiming);
+
+   // Receive through CAN_RxIsr, at its address in RAM. Any interrupt the
+   // application left enabled would vector into flash, so only eCAN-A
+   // interrupt 0 is allowed.
+   canRingHead = 0;
+   canRingTail = 0;
+   canLost = 0;
+   DINT;
+   IER = 0x0000;
+   IFR = 0x0000;
+   PieCtrlRegs.PIECTRL.bit.ENPIE = 1;
+   PieVectTable.ECAN0INTA = &CAN_RxIsr;
+   PieCtrlRegs.PIEIER9.all = 0x0010;		// INT9.5, ECAN0INTA
+   IER |= M_INT9;
+   EINT;
+
+   returnAddr = Bootload(slot, profile);
+
+   DINT;
+   IER = 0x0000;
+   PieCtrlRegs.PIEIER9.all = 0;
    return returnAddr;
 }
 
 
 //#################################################
-// void CAN_Init(void)
+// Uint16 Clock_IsConfigured(void)
+//----------------------------------------------
+// Returns 1 if the PLL is locked at the rate
+// InitSysCtrl() would set, as described by the
+// application handoff.
+//----------------------------------------------
+
+#pragma CODE_SECTION(Clock_IsConfigured, ".OTP_INIT")
+Uint16 Clock_IsConfigured(void)
+{
+	Uint16 pllConfig = (DSP28_DIVSEL << 8) | DSP28_PLLCR;
+
+	return (BootHandoff.PllConfig == pllConfig) &&
+		   (((SysCtrlRegs.PLLSTS.bit.DIVSEL << 8) | SysCtrlRegs.PLLCR.bit.DIV) == pllConfig) &&
+		   (SysCtrlRegs.PLLSTS.bit.PLLLOCKS == 1) &&
+		   (SysCtrlRegs.PLLSTS.bit.MCLKSTS == 0);
+}
+
+
+//#################################################
+// void CAN_Init(Uint16 profile, Uint16 keepBitTiming)
 //----------------------------------------------
 // Initialize the CAN-A port for communications
-// with the host.
+// with the host in the given bit timing profile.
+// If keepBitTiming is set and the handed off bit
+// timing matches the profile, the configuration
+// mode round trip is skipped.
 //----------------------------------------------
 
-#pragma CODE_SECTION(CAN_Init, ".OTP_INIT")
-void CAN_Init()
+#pragma CODE_SECTION(CAN_Init, ".LOADER")
+void CAN_Init(Uint16 profile, Uint16 keepBitTiming)
 {
 
 /* Create a shadow register structure for the CAN control registers. This is
@@ -238,36 +529,16 @@ void CAN_Init()
    ECanaRegs.CANGIF0.all = 0xFFFFFFFF;
    ECanaRegs.CANGIF1.all = 0xFFFFFFFF;
 
-/* Configure bit timing parameters for eCANA*/
-
-   ECanaShadow.CANMC.all = ECanaRegs.CANMC.all;
-   ECanaShadow.CANMC.bit.CCR = 1 ;            // Set CCR = 1
-   ECanaRegs.CANMC.all = ECanaShadow.CANMC.all;
-
-
-
-   do
-   {
-     ECanaShadow.CANES.all = ECanaRegs.CANES.all;
-   } while(ECanaShadow.CANES.bit.CCE != 1 );    // Wait for CCE bit to be set..
-
-   ECanaShadow.CANBTC.all = 0;
-   ECanaShadow.CANBTC.bit.BRPREG = 1;
-   ECanaShadow.CANBTC.bit.TSEG1REG = 10;
-   ECanaShadow.CANBTC.bit.TSEG2REG = 2;
-   ECanaShadow.CANBTC.bit.SJWREG = 1;
-   ECanaShadow.CANBTC.bit.SAM = 0;
-   ECanaRegs.CANBTC.all = ECanaShadow.CANBTC.all;
-
-   ECanaShadow.CANMC.all = ECanaRegs.CANMC.all;
-   ECanaShadow.CANMC.bit.CCR = 0 ;            // Set CCR = 0
-   ECanaRegs.CANMC.all = ECanaShadow.CANMC.all;
-
+/* Configure bit timing parameters for eCANA. This is skipped when the
+ application handed over a running module with the same bit timing, which
+ saves the two round trips through configuration mode. */
 
-   do
+   if (!keepBitTiming || (BootHandoff.CanBtc != ECanaRegs.CANBTC.all) ||
+       (ECanaRegs.CANBTC.all != CAN_BTC(profile)) ||
+       (ECanaRegs.CANES.bit.CCE != 0))
    {
-     ECanaShadow.CANES.all = ECanaRegs.CANES.all;
-   } while(ECanaShadow.CANES.bit.CCE != 0 );  // Wait for CCE bit to be cleared..
+      CAN_SetBitTiming(profile);
+   }
 
 
 /* Disable all Mailboxes  */
@@ -282,6 +553,11 @@ void CAN_Init()
 /* Configure MBOX2 to be a transmit MBOX */
    ECanaRegs.CANMD.all = 0x0002;
 
+/* MBOX1 receive interrupts on ECAN0INT, nothing else */
+   ECanaRegs.CANMIM.all = 0x0002;
+   ECanaRegs.CANMIL.all = 0x0000;
+   ECanaRegs.CANGIM.all = 0x0001;
+
 /* Enable MBOX1 and MBOX2 */
 
    ECanaRegs.CANME.all = 0x0006;
@@ -292,6 +568,63 @@ void CAN_Init()
 }
 
 
+//#################################################
+// void CAN_SetBitTiming(Uint16 profile)
+//----------------------------------------------
+// Switch eCAN-A to a BOOT_PROFILE_x bit timing
+// through configuration mode. Any transmission
+// must have completed before this is called.
+//----------------------------------------------
+
+#pragma CODE_SECTION(CAN_SetBitTiming, ".LOADER")
+void CAN_SetBitTiming(Uint16 profile)
+{
+   struct ECAN_REGS ECanaShadow;
+
+   EALLOW;
+   ECanaShadow.CANMC.all = ECanaRegs.CANMC.all;
+   ECanaShadow.CANMC.bit.CCR = 1 ;            // Set CCR = 1
+   ECanaRegs.CANMC.all = ECanaShadow.CANMC.all;
+
+   do
+   {
+     ECanaShadow.CANES.all = ECanaRegs.CANES.all;
+   } while(ECanaShadow.CANES.bit.CCE != 1 );    // Wait for CCE bit to be set..
+
+   ECanaRegs.CANBTC.all = CAN_BTC(profile);
+
+   ECanaShadow.CANMC.all = ECanaRegs.CANMC.all;
+   ECanaShadow.CANMC.bit.CCR = 0 ;            // Set CCR = 0
+   ECanaRegs.CANMC.all = ECanaShadow.CANMC.all;
+
+   do
+   {
+     ECanaShadow.CANES.all = ECanaRegs.CANES.all;
+   } while(ECanaShadow.CANES.bit.CCE != 0 );  // Wait for CCE bit to be cleared..
+}
+
+
+//#################################################
+// void CAN_SendReply(Uint32 mdl, Uint32 mdh)
+//----------------------------------------------
+// Send a reply frame to the host on MBOX2 and
+// wait for it to be acknowledged on the bus.
+//----------------------------------------------
+
+#pragma CODE_SECTION(CAN_SendReply, ".LOADER")
+void CAN_SendReply(Uint32 mdl, Uint32 mdh)
+{
+	ECanaRegs.CANMC.all = 2 | (0x100);
+	ECanaMboxes.MBOX2.MDH.all = mdh;
+	ECanaMboxes.MBOX2.MDL.all = mdl;
+	ECanaRegs.CANMC.all = 2;
+	ECanaRegs.CANTRS.all = 0x4;
+
+	while(ECanaRegs.CANTA.all != 0x4 ) {}  // Wait for all TAn bits to be set..
+	ECanaRegs.CANTA.all = 0x4;   // Clear all TAn
+}
+
+
 //#################################################
 // Uint16 CAN_GetWordData(void)
 //-----------------------------------------------
@@ -329,37 +662,163 @@ Uint16 CAN_GetWordData()
 }
 */
 
-#pragma CODE_SECTION(CopyToRam, ".OTP_INIT")
-void CopyToRam(Uint16 * ramAddr, Uint16 * otpAddr)
+//#################################################
+// void CRC16_Init(void)
+//-----------------------------------------------
+// Generate the byte-wise CRC16 lookup table in RAM.
+//-----------------------------------------------
+
+#pragma CODE_SECTION(CRC16_Init, "ramfuncs")
+void CRC16_Init(void)
 {
-	Uint16 words = OTP_END - otpAddr;
 	Uint16 i;
+	Uint16 bit;
+	Uint16 crc;
 
-	for(i = 0; i < words; i++)
+	for (i = 0; i < 256; i++)
 	{
-		*ramAddr = *otpAddr;
-		ramAddr++;
-		otpAddr++;
+		crc = i << 8;
+		for (bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 0x8000) ? ((crc << 1) ^ CRC16_POLY) : (crc << 1);
+		}
+		crcTable[i] = crc;
 	}
+}
+
+//#################################################
+// Uint16 CRC16_Calc(Uint16 crc, Uint16 * addr, Uint32 length)
+//-----------------------------------------------
+// Continue a CRC16 over length words starting at
+// addr. Each word is fed MSB first, two table
+// lookups per word. CRC16_Init() must have run.
+// Runs from RAM, it covers the whole image on
+// every boot.
+//-----------------------------------------------
 
+#pragma CODE_SECTION(CRC16_Calc, "ramfuncs")
+Uint16 CRC16_Calc(Uint16 crc, Uint16 * addr, Uint32 length)
+{
+	Uint16 word;
+
+	while (length--)
+	{
+		word = *addr++;
+		crc = (crc << 8) ^ crcTable[((crc >> 8) ^ (word >> 8)) & 0xFF];
+		crc = (crc << 8) ^ crcTable[((crc >> 8) ^ word) & 0xFF];
+	}
+	return crc;
+}
+
+//#################################################
+// Uint16 App_IsValid(Uint16 slot)
+//-----------------------------------------------
+// Returns 1 if the slot's application header is
+// complete and the CRC of the image in flash
+// matches it.
+//-----------------------------------------------
+
+#pragma CODE_SECTION(App_IsValid, ".OTP_INIT")
+Uint16 App_IsValid(Uint16 slot)
+{
+	struct APP_HEADER * header = APP_HEADER(slot);
+
+	if (header->Status != FLASH_SUCCESS)
+	{
+		return 0;
+	}
+	if ((header->Length == 0) || (header->StartAddr < SLOT_START(slot) + APP_HEADER_SIZE) ||
+		(header->StartAddr > SLOT_END(slot)) ||
+		(header->Length > SLOT_END(slot) + 1 - header->StartAddr))
+	{
+		return 0;
+	}
+	return CRC16_Calc(CRC16_INIT, (Uint16 *) header->StartAddr, header->Length) == header->Crc;
+}
+
+//#################################################
+// Uint16 App_SelectSlot(void)
+//-----------------------------------------------
+// Returns the slot to run: the newest slot with a
+// valid image, else the other slot if it is valid,
+// else APP_NO_SLOT. Only the slot that is picked
+// (plus the fallback, on failure) is CRC checked.
+//-----------------------------------------------
+
+#pragma CODE_SECTION(App_SelectSlot, ".OTP_INIT")
+Uint16 App_SelectSlot(void)
+{
+	Uint16 newest = 0;
+
+	if ((APP_HEADER(1)->Status == FLASH_SUCCESS) &&
+		((APP_HEADER(0)->Status != FLASH_SUCCESS) ||
+		 ((int32)(APP_HEADER(1)->Sequence - APP_HEADER(0)->Sequence) > 0)))
+	{
+		newest = 1;
+	}
+
+	if (App_IsValid(newest))
+	{
+		return newest;
+	}
+	if (App_IsValid(newest ^ 1))
+	{
+		return newest ^ 1;
+	}
+	return APP_NO_SLOT;
 }
 
 
-#pragma CODE_SECTION(Bootload, ".OTP")
-Uint32 Bootload(void)
+#pragma CODE_SECTION(Bootload, ".LOADER")
+Uint32 Bootload(Uint16 slot, Uint16 profile)
 {
 	Uint32 EntryAddr;
 	EALLOW;
 
 	Uint32 wordData;
-	Uint16 byteData;
-	Uint16 count = 0;
+	Uint32 count = 0;	// Frames programmed. Sequence numbers are its low half.
+	Uint16 i = 0;
+	Uint16 k;
+	Uint16 words;
+	Uint16 rawWord;
+	Uint32 nextWords;
+	Uint16 state = STREAM_HEADER;
+	Uint16 status = BOOT_STATUS_SUCCESS;
+	Uint32 heartbeat = ((Uint32) slot << 16) | BOOT_STATUS_HEARTBEAT;
+	Uint16 startProfile = profile;
+	Uint16 idleBeats = 0;
+	Uint32 delay;
+	Uint16 command;
+	Uint16 argument;
+	Uint16 seq;
+	Uint16 ackInterval = 0;
+	Uint16 sinceAck = 0;
+	Uint32 nacked = 0;
+	Uint16 lostSeen = 0;	// canLost at the last WINDOW or NACK
+	Uint16 gapHead = CAN_RING_SIZE;
+	Uint16 erased = 0;		// SECTORx mask, blank ones not erased shifted up 8
+	Uint32 commandData;		// MDH of a command frame
+	Uint32 expectedCrc = 0xFFFFFFFFUL;	// From BOOT_CMD_EXPECT_CRC, none if above 0xFFFF
+	Uint16 * readWord;
+	Uint16 * ramWord;
+	volatile struct CAN_FRAME * frame;
+	struct CAN_FRAME held;
 
 	struct HEADER {
 	Uint16 BlockSize;
 	Uint32 DestAddr;
 	} BlockHeader;
 
+	// Where blocks may go, and the span covered by the image, recorded in
+	// the application header
+	Uint16 ram = (slot == BOOT_SLOT_RAM);
+	Uint32 loadStart = ram ? RAM_LOAD_START : SLOT_START(slot) + APP_HEADER_SIZE;
+	Uint32 loadEnd = ram ? RAM_LOAD_END : SLOT_END(slot);
+	Uint32 ImageStart = loadEnd + 1;
+	Uint32 ImageEnd = loadStart;
+	struct APP_HEADER AppHeader;
+	struct APP_HEADER * otherHeader = APP_HEADER(slot ^ 1);
+
 	FLASH_ST FlashStatus;
 
 /*------------------------------------------------------------------
@@ -402,262 +861,604 @@ NULL is defined in <stdio.h>.
 
 	ECanaRegs.CANMC.all = 2;
 
-	if (Flash_Erase(SECTOR_F2803x, &FlashStatus) != 0)
+	// Only the target slot is erased, the other slot keeps running until
+	// the new image is complete. A host that answers the hello with a
+	// window paces the stream to our acks, so its sectors are erased as
+	// the image reaches them and the stream starts right away. Anyone else
+	// gets the whole slot erased before the first heartbeat. The hello
+	// goes out on its own MSGID, see BOOT_HELLO_ID.
+	ECanaRegs.CANME.all = 0;
+	ECanaMboxes.MBOX2.MSGID.all = (Uint32) BOOT_HELLO_ID << 18;
+	ECanaRegs.CANME.all = 0x0006;
+	CAN_SendReply(((Uint32) slot << 16) | BOOT_STATUS_HELLO, BOOT_CAPS);
+	ECanaRegs.CANME.all = 0;
+	ECanaMboxes.MBOX2.MSGID.all = 0x00080000;
+	ECanaRegs.CANME.all = 0x0006;
+	for (delay = 0; (delay < HELLO_WAIT) && (canRingHead == canRingTail); delay++)
 	{
-		ECanaRegs.CANMC.all = 2 | (0x100);
-		ECanaMboxes.MBOX2.MDH.all = 0xFFFF;
-		ECanaMboxes.MBOX2.MDL.all =  0xFFFE;
-		ECanaRegs.CANMC.all = 2;
-		ECanaRegs.CANTRS.all = 0x4;
-
-		while(ECanaRegs.CANTA.all != 0x4 ) {}  // Wait for all TAn bits to be set..
-		ECanaRegs.CANTA.all = 0x4;   // Clear all TAn
+	}
+	frame = &canRing[canRingTail];
+	if (!ram && ((canRingHead == canRingTail) ||
+				 ((frame->Mdl & 0xFFFFFF00) != ((Uint32) BOOT_CMD_WINDOW << 8)) ||
+				 ((frame->Mdl & 0xFF) == 0)) &&
+		(Slot_EraseTo(slot, SLOT_END(slot), &erased) != 0))
+	{
+		CAN_SendReply(BOOT_STATUS_FAIL_ERASE, 0xFFFF);
 		return LOAD_ADDRESS_ON_FAIL;
 	}
 
-
-
-	Uint16 i;
-	// Read and discard the 8 reserved words.
-	for(i = 0; i < 12; i++)
-	{
-		wordData = 0x0000;
-		byteData = 0x0000;
-		Uint32 delay = 0;
-		// Fetch the LSB
-		while(ECanaRegs.CANRMP.all == 0) {
-
-			delay++;
-		    if (delay >= 3000000) {
-				ECanaRegs.CANTRS.all = 0x4;
-
-				while(ECanaRegs.CANTA.all != 0x4 ) {}  // Wait for all TAn bits to be set..
-				ECanaRegs.CANTA.all = 0x4;   // Clear all TAn
-				delay = 0;
-		    }
-		}
-		count++;
-		if (count != ECanaMboxes.MBOX1.MDL.word.HI_WORD)
+	// The RAM load area starts out as erased flash would, so the words
+	// between blocks CRC as 0xFFFF there too, which is what the host
+	// expects, rather than whatever the RAM held.
+	if (ram)
+	{
+		for (ramWord = (Uint16 *) loadStart; ramWord <= (Uint16 *) loadEnd; ramWord++)
 		{
-			ECanaRegs.CANMC.all = 2 | (0x100);
-			ECanaMboxes.MBOX2.MDH.all = 0xFFFF;
-			ECanaMboxes.MBOX2.MDL.all =  0xFFFF;
-			ECanaRegs.CANMC.all = 2;
-			ECanaRegs.CANTRS.all = 0x4;
-
-			while(ECanaRegs.CANTA.all != 0x4 ) {}  // Wait for all TAn bits to be set..
-			ECanaRegs.CANTA.all = 0x4;   // Clear all TAn
-
-			return LOAD_ADDRESS_ON_FAIL;
+			*ramWord = 0xFFFF;
 		}
+	}
 
-		wordData =  (Uint16) ECanaMboxes.MBOX1.MDL.byte.BYTE2;	// LS byte
-		byteData =  (Uint16)ECanaMboxes.MBOX1.MDL.byte.BYTE3;	// MS byte
-
-		// form the wordData from the MSB:LSB
-		wordData |= (byteData << 8);
+	// Heartbeats tell the host which slot the image must be linked for.
+	// Send the first one as soon as the loader is ready instead of waiting
+	// for the receive timeout, so the host can start right away.
+	CAN_SendReply(heartbeat, BOOT_CAPS);
 
-		if (i == 0)
+	// CAN_RxIsr queues every frame in canRing. Take them out one at a time
+	// and program data words as they arrive. Frames that come in meanwhile
+	// wait in the ring. While a frame is missing, gapHead holds canRingHead
+	// as it was at the last search, so only new arrivals wake the loop.
+	while (state != STREAM_DONE)
+	{
+		delay = 0;
+		while ((canRingHead == canRingTail) || (canRingHead == gapHead))
 		{
-			// If the KeyValue was invalid, abort the load
-			// and return the flash entry point.
-			if (wordData != 0x08AA)
+			if (++delay < 3000000)
 			{
-				ECanaRegs.CANMC.all = 2 | (0x100);
-				ECanaMboxes.MBOX2.MDH.all = 0xFFFF;
-				ECanaMboxes.MBOX2.MDL.all =  0xFFFD;
-				ECanaRegs.CANMC.all = 2;
-				ECanaRegs.CANTRS.all = 0x4;
-
-				while(ECanaRegs.CANTA.all != 0x4 ) {}  // Wait for all TAn bits to be set..
-				ECanaRegs.CANTA.all = 0x4;   // Clear all TAn
-				return LOAD_ADDRESS_ON_FAIL;
+				continue;
+			}
+			delay = 0;
+			if (count == 0)
+			{
+				// Heartbeat until the stream starts. A host that could not
+				// follow a profile switch goes quiet, fall back to the
+				// starting profile so it can find us again.
+				if ((profile != startProfile) && (++idleBeats >= PROFILE_REVERT_BEATS))
+				{
+					profile = startProfile;
+					CAN_SetBitTiming(profile);
+				}
+				CAN_SendReply(heartbeat, BOOT_CAPS);
+			}
+			else if (++idleBeats >= STREAM_STALL_BEATS)
+			{
+				// The host is gone. Fail so it can start over.
+				status = BOOT_STATUS_FAIL_SEQUENCE;
+				break;
+			}
+			else if (ackInterval != 0)
+			{
+				// Most likely the next frame, or our NACK for it, was lost
+				CAN_SendReply(((Uint32) CAN_RxHealth(&lostSeen) << 16) | BOOT_STATUS_NACK, count + 1);
 			}
 		}
-		// Fetch the upper 1/2 of the EntryAddr
-		if (i == 9)
+		if (status != BOOT_STATUS_SUCCESS)
 		{
-			EntryAddr = wordData << 16;
+			break;
 		}
-		// Fetch the lower 1/2 of the EntryAddr
-		if (i == 10)
+		frame = &canRing[canRingTail];
+		seq = frame->Mdl >> 16;
+
+		// Until the stream starts the host may send commands. They carry
+		// sequence number 0, which the stream never uses.
+		if ((count == 0) && (seq == 0))
 		{
-			EntryAddr |= wordData;
+			command = (frame->Mdl >> 8) & 0xFF;
+			argument = frame->Mdl & 0xFF;
+			commandData = frame->Mdh;
+			canRingTail = (canRingTail + 1) & (CAN_RING_SIZE - 1);
+			idleBeats = 0;
+
+			if (command == BOOT_CMD_PING)
+			{
+				CAN_SendReply(((Uint32) command << 16) | BOOT_STATUS_ACK, 0);
+			}
+			else if ((command == BOOT_CMD_SLOT_INFO) && (argument < APP_SLOT_COUNT))
+			{
+				CAN_SendReply(((Uint32) command << 16) | BOOT_STATUS_ACK,
+							  ((Uint32) SLOT_SECTORS(argument) << 24) | SLOT_START(argument));
+			}
+			else if ((command == BOOT_CMD_SLOT_CRC) && (argument < APP_SLOT_COUNT))
+			{
+				// What the header says, without reading the image
+				CAN_SendReply(((Uint32) command << 16) | BOOT_STATUS_ACK,
+							  (APP_HEADER(argument)->Status == FLASH_SUCCESS) ?
+							  (((Uint32) APP_HEADER(argument)->Crc << 16) | (Uint16) APP_HEADER(argument)->Length) :
+							  0xFFFFFFFFUL);
+			}
+			else if ((command == BOOT_CMD_READ) && (argument != 0) && (commandData >= READ_START) &&
+					 (commandData <= READ_END + 1 - ((Uint32) argument << 2)))
+			{
+				// Four words per frame, each MSB first, then the CRC of them all.
+				// CAN_SendReply() waits for each frame to go out, so this runs
+				// at the bus rate. Requests behind this one wait in the ring.
+				readWord = (Uint16 *) commandData;
+				for (k = 0; k < argument; k++)
+				{
+					CAN_SendReply(((Uint32) readWord[0] << 16) | readWord[1],
+								  ((Uint32) readWord[2] << 16) | readWord[3]);
+					readWord += 4;
+				}
+				CAN_SendReply(((Uint32) command << 16) | BOOT_STATUS_ACK,
+							  CRC16_Calc(CRC16_INIT, (Uint16 *) commandData, (Uint32) argument << 2));
+			}
+			else if ((command == BOOT_CMD_SET_IDS) && ((commandData & 0xF800F800UL) == 0) &&
+					 ((Uint16) (commandData >> 16) != (Uint16) commandData))
+			{
+				// Acknowledge on the old IDs. The mailboxes must be disabled
+				// while their MSGIDs change, the host waits for the ACK.
+				CAN_SendReply(((Uint32) command << 16) | BOOT_STATUS_ACK, commandData);
+				ECanaRegs.CANME.all = 0;
+				ECanaMboxes.MBOX1.MSGID.all = (commandData >> 16) << 18;
+				ECanaMboxes.MBOX2.MSGID.all = (commandData & 0x7FF) << 18;
+				ECanaRegs.CANME.all = 0x0006;
+			}
+			else if ((command == BOOT_CMD_SELF_TEST) && (argument != 0) && (canRingHead == canRingTail))
+			{
+				commandData = CAN_RxBench(argument);
+				CAN_SendReply(((Uint32) command << 16) |
+							  ((commandData != 0xFFFFFFFFUL) ? BOOT_STATUS_ACK : BOOT_STATUS_FAIL_COMMAND), commandData);
+			}
+			else if ((command == BOOT_CMD_EXPECT_CRC) && ((commandData >> 16) == 0))
+			{
+				expectedCrc = commandData;
+				CAN_SendReply(((Uint32) command << 16) | BOOT_STATUS_ACK, commandData);
+			}
+			else if ((command == BOOT_CMD_SET_PROFILE) && (argument <= BOOT_PROFILE_MAX))
+			{
+				// Acknowledge in the old bit timing, then heartbeat in the new one
+				CAN_SendReply(((Uint32) command << 16) | BOOT_STATUS_ACK, argument);
+				profile = argument;
+				CAN_SetBitTiming(profile);
+				CAN_SendReply(heartbeat, BOOT_CAPS);
+			}
+			else if ((command == BOOT_CMD_WINDOW) && (argument < CAN_RING_SIZE))
+			{
+				ackInterval = argument;
+				CAN_SendReply(((Uint32) command << 16) | BOOT_STATUS_ACK, argument);
+			}
+			else if ((command == BOOT_CMD_KEEP) && !ram && (argument != 0) && ((argument & erased) == 0) &&
+					 ((argument & ~(SLOT_SECTORS(slot) & ~SECTOR_BIT(SLOT_START(slot)))) == 0))
+			{
+				// The host knows these sectors only need bits cleared. Count
+				// them as erased so Slot_EraseTo() leaves them be. The header
+				// sector is always erased.
+				erased |= argument;
+				CAN_SendReply(((Uint32) command << 16) | BOOT_STATUS_ACK, argument);
+			}
+			else
+			{
+				CAN_SendReply(((Uint32) command << 16) | BOOT_STATUS_FAIL_COMMAND, 0);
+			}
+			continue;
 		}
 
-		if (i == 11)
+		// Out of order frames fail the load unless the host asked for a
+		// window. Then frames already programmed are dropped, and a missing
+		// frame is taken from further up the ring if it came in late. If it
+		// is not there, NACK it once and keep the frames behind it.
+		if (seq != (Uint16) (count + 1))
 		{
-			// Get the size in words of the first block
-			BlockHeader.BlockSize = wordData;
+			if (ackInterval == 0)
+			{
+				status = BOOT_STATUS_FAIL_SEQUENCE;
+				break;
+			}
+			if ((Uint16) (seq - count - 1) >= 0x8000)
+			{
+				canRingTail = (canRingTail + 1) & (CAN_RING_SIZE - 1);
+				continue;
+			}
+			for (k = (canRingTail + 1) & (CAN_RING_SIZE - 1); k != canRingHead; k = (k + 1) & (CAN_RING_SIZE - 1))
+			{
+				if ((Uint16) (canRing[k].Mdl >> 16) == (Uint16) (count + 1))
+				{
+					break;
+				}
+			}
+			if (k == canRingHead)
+			{
+				if (nacked != count + 1)
+				{
+					nacked = count + 1;
+					CAN_SendReply(((Uint32) CAN_RxHealth(&lostSeen) << 16) | BOOT_STATUS_NACK, nacked);
+				}
+				gapHead = canRingHead;
+				continue;
+			}
+			held = canRing[k];
+			canRing[k] = canRing[canRingTail];
+			canRing[canRingTail] = held;
 		}
-		/* Clear all RMPn bits */
-		ECanaRegs.CANRMP.all = 0xFFFFFFFF;
-	}
-
-	/*
-	* ==================================================================
-	*  Copy program data section
-	* ==================================================================
-	*/
-
-	// While the block size is > 0 copy the data
-	// to the DestAddr.  There is no error checking
-	// as it is assumed the DestAddr is a valid
-	// memory location
-
-	while(BlockHeader.BlockSize != (Uint16)0x0000)
-	{
-		for(i = 0; i < 2; i++)
+		count++;
+		gapHead = CAN_RING_SIZE;
+		idleBeats = 0;
+		// A frame carries one to three words after the sequence number,
+		// each LSB first. Anything after the end of the stream is padding.
+		words = (frame->Dlc > 2) ? ((frame->Dlc - 2) >> 1) : 0;
+		rawWord = frame->Mdl;
+		nextWords = frame->Mdh;
+		canRingTail = (canRingTail + 1) & (CAN_RING_SIZE - 1);
+
+		for (k = 0; (k < words) && (state != STREAM_DONE) && (status == BOOT_STATUS_SUCCESS); k++)
 		{
-			wordData = 0x0000;
-			byteData = 0x0000;
-
-			// Fetch the LSB
-			while(ECanaRegs.CANRMP.all == 0) { }
-			count++;
-			if (count != ECanaMboxes.MBOX1.MDL.word.HI_WORD)
+			wordData = ((rawWord >> 8) & 0x00FF) | ((rawWord << 8) & 0xFF00);
+			rawWord = nextWords >> 16;
+			nextWords <<= 16;
+
+			// Data words first, they are by far the most common. This is an if
+			// chain rather than a switch, whose jump table would not be part of
+			// the OTP image.
+			if (state == STREAM_DATA)
 			{
-				ECanaRegs.CANMC.all = 2 | (0x100);
-				ECanaMboxes.MBOX2.MDH.all = 0xFFFFFFFF;
-				ECanaMboxes.MBOX2.MDL.all = 0xFFFFFFFF;
-				ECanaRegs.CANMC.all = 2;
-				ECanaRegs.CANTRS.all = 0x4;
-
-				while(ECanaRegs.CANTA.all != 0x4 ) {}  // Wait for all TAn bits to be set..
-				ECanaRegs.CANTA.all = 0x4;   // Clear all TAn
-
-				return LOAD_ADDRESS_ON_FAIL;
+				if (ram)
+				{
+					*(Uint16 *) BlockHeader.DestAddr = wordData;
+				}
+				else if (Flash_Program((Uint16 *) BlockHeader.DestAddr, (Uint16 *) &wordData, 1, &FlashStatus) != 0)
+				{
+					status = BOOT_STATUS_FAIL_PROGRAM;
+				}
+				BlockHeader.DestAddr++;
+				if (++i == BlockHeader.BlockSize)
+				{
+					state = STREAM_SIZE;
+				}
 			}
-			wordData =  (Uint16) ECanaMboxes.MBOX1.MDL.byte.BYTE2;	// LS byte
-			byteData =  (Uint16)ECanaMboxes.MBOX1.MDL.byte.BYTE3;	// MS byte
-
-			// form the wordData from the MSB:LSB
-			wordData |= (byteData << 8);
-
-			// Fetch the upper 1/2 of the DestAddr
-			if (i == 0)
+			else if (state == STREAM_HEADER)
 			{
+				// Key value, 8 reserved words and the entry point
+				if ((i == 0) && (wordData != 0x08AA))
+				{
+					status = BOOT_STATUS_FAIL_KEY;
+				}
+				if (i == 9)
+				{
+					EntryAddr = wordData << 16;
+				}
+				if (i == 10)
+				{
+					EntryAddr |= wordData;
+					state = STREAM_SIZE;
+				}
+				i++;
+			}
+			else if (state == STREAM_SIZE)
+			{
+				// A block size of zero ends the stream
+				BlockHeader.BlockSize = wordData;
+				state = (wordData == 0) ? STREAM_DONE : STREAM_ADDR;
+				i = 0;
+			}
+			else if (++i < 2)
+			{
+				// Upper half of the block's DestAddr
 				BlockHeader.DestAddr = wordData << 16;
 			}
-			// Fetch the lower 1/2 of the DestAddr
-			if (i == 1)
+			else
 			{
 				BlockHeader.DestAddr |= wordData;
+
+				// Every block must land in the target slot, behind its header,
+				// or in the RAM load area
+				if ((BlockHeader.DestAddr < loadStart) ||
+					(BlockHeader.DestAddr + BlockHeader.BlockSize > loadEnd + 1))
+				{
+					status = BOOT_STATUS_FAIL_SLOT;
+				}
+				if (BlockHeader.DestAddr < ImageStart)
+				{
+					ImageStart = BlockHeader.DestAddr;
+				}
+				if (BlockHeader.DestAddr + BlockHeader.BlockSize > ImageEnd)
+				{
+					ImageEnd = BlockHeader.DestAddr + BlockHeader.BlockSize;
+				}
+				if ((status == BOOT_STATUS_SUCCESS) && !ram &&
+					(Slot_EraseTo(slot, ImageEnd - 1, &erased) != 0))
+				{
+					status = BOOT_STATUS_FAIL_ERASE;
+				}
+				state = STREAM_DATA;
+				i = 0;
 			}
+		}
 
-			/* Clear all RMPn bits */
-			ECanaRegs.CANRMP.all = 0xFFFFFFFF;
+		if (status != BOOT_STATUS_SUCCESS)
+		{
+			break;
 		}
 
-		for(i = 1; i <= BlockHeader.BlockSize; i++)
+		// Tell a windowed host how far we got, so it can send more
+		if ((ackInterval != 0) && (++sinceAck >= ackInterval) && (state != STREAM_DONE))
 		{
-			wordData = 0x0000;
-			byteData = 0x0000;
+			sinceAck = 0;
+			CAN_SendReply(((Uint32) CAN_RxHealth(&lostSeen) << 16) | BOOT_STATUS_WINDOW, count);
+		}
+	}
 
-			// Fetch the LSB
-			while(ECanaRegs.CANRMP.all == 0) { }
-			count ++;
-			if (count != ECanaMboxes.MBOX1.MDL.word.HI_WORD)
-			{
-				ECanaRegs.CANMC.all = 2 | (0x100);
-				ECanaMboxes.MBOX2.MDH.all = 0xFFFF;
-				ECanaMboxes.MBOX2.MDL.all = 0xFFFF;
-				ECanaRegs.CANMC.all = 2;
-				ECanaRegs.CANTRS.all = 0x4;
+	if (status != BOOT_STATUS_SUCCESS)
+	{
+		CAN_SendReply(status, 0xFFFF);
+		return LOAD_ADDRESS_ON_FAIL;
+	}
+
+	// Record the image span, CRC and entry point, then mark the slot complete.
+	// The status word goes last so an interrupted header never validates, and
+	// the sequence number makes this slot the newest one on the next boot.
+	if (ImageEnd <= ImageStart)
+	{
+		ImageStart = loadStart;
+		ImageEnd = ImageStart;
+	}
+	AppHeader.Status = FLASH_SUCCESS;
+	AppHeader.StartAddr = ImageStart;
+	AppHeader.Length = ImageEnd - ImageStart;
+	AppHeader.Crc = CRC16_Calc(CRC16_INIT, (Uint16 *) AppHeader.StartAddr, AppHeader.Length);
+	AppHeader.Sequence = (otherHeader->Status == FLASH_SUCCESS) ? otherHeader->Sequence + 1 : 1;
+	AppHeader.EntryAddr = EntryAddr;
+
+	// What was written must be what the host sent. Otherwise the header is
+	// not written, so the slot never validates, and a RAM image is not run.
+	// The boot request stays, and the loader starts over.
+	if ((expectedCrc <= 0xFFFF) && (AppHeader.Crc != (Uint16) expectedCrc))
+	{
+		CAN_SendReply(BOOT_STATUS_FAIL_CRC, AppHeader.Crc);
+		return LOAD_ADDRESS_ON_FAIL;
+	}
 
-				while(ECanaRegs.CANTA.all != 0x4 ) {}  // Wait for all TAn bits to be set..
-				ECanaRegs.CANTA.all = 0x4;   // Clear all TAn
+	Uint16 * modeAddr = (Uint16 *) BOOT_MODE_ADDR;
+	for (i = 0; i < 4; i++)
+	{
+		*modeAddr++ = 0;
+	}
+	BootHandoff.Flags = 0;
 
-				return LOAD_ADDRESS_ON_FAIL;
-			}
-			wordData =  (Uint16) ECanaMboxes.MBOX1.MDL.byte.BYTE2;	// LS byte
+	if (!ram &&
+		((Slot_EraseTo(slot, SLOT_START(slot), &erased) != 0) ||
+		 (Flash_Program(((Uint16 *) APP_HEADER(slot)) + 1, ((Uint16 *) &AppHeader) + 1,
+						sizeof(AppHeader) - 1, &FlashStatus) != 0) ||
+		 (Flash_Program(((Uint16 *) APP_HEADER(slot)), &AppHeader.Status, 1, &FlashStatus) != 0)))
+	{
+		CAN_SendReply(BOOT_STATUS_FAIL_PROGRAM, 0xFFFF);
+		return LOAD_ADDRESS_ON_FAIL;
+	}
 
-			// Fetch the MSB
+	CAN_SendReply(((Uint32) (erased >> 8) << 16) | BOOT_STATUS_SUCCESS, AppHeader.Crc);
 
-			byteData =  (Uint16)ECanaMboxes.MBOX1.MDL.byte.BYTE3;	// MS byte
+	EALLOW;
+	SysCtrlRegs.WDCR = 0x0028; // Enable watchdog module
+	SysCtrlRegs.WDKEY = 0x55;  // Clear the WD counter
+	SysCtrlRegs.WDKEY = 0xAA;
+	EDIS;
 
-			// form the wordData from the MSB:LSB
-			wordData |= (byteData << 8);
+	return EntryAddr;
+}
 
-			/* Clear all RMPn bits */
-			ECanaRegs.CANRMP.all = 0xFFFFFFFF;
+//#################################################
+// Uint16 Slot_EraseTo(Uint16 slot, Uint32 end, Uint16 * erased)
+//-----------------------------------------------
+// Erase the sectors from the start of slot up to
+// the one holding address end, skipping those in
+// the erased mask, and add them to it. Erasing
+// from the slot start covers the header and any
+// gap between blocks. Sectors that are already
+// blank are not erased, they go to the upper byte
+// of the mask. Returns the Flash_Erase() status.
+//-----------------------------------------------
+
+#pragma CODE_SECTION(Slot_EraseTo, ".LOADER")
+Uint16 Slot_EraseTo(Uint16 slot, Uint32 end, Uint16 * erased)
+{
+	FLASH_ST FlashStatus;
+	Uint16 sectors = ((SECTOR_BIT(SLOT_START(slot)) << 1) - SECTOR_BIT(end)) & ~*erased;
+	Uint16 bit;
+	Uint16 * addr;
+	Uint16 * sectorEnd = (Uint16 *) (SECTOR_A_START + SECTOR_WORDS);
 
-			//*(Uint16 *)BlockHeader.DestAddr++ = wordData;
-			if (Flash_Program((Uint16 *) BlockHeader.DestAddr, &wordData, 1, &FlashStatus) != 0)
+	*erased |= sectors;
+
+	// Blank check, stopping at the first programmed word
+	for (bit = SECTORA; bit <= SECTORH; bit <<= 1)
+	{
+		addr = sectorEnd - SECTOR_WORDS;
+		if (sectors & bit)
+		{
+			while ((addr < sectorEnd) && (*addr == 0xFFFF))
+			{
+				addr++;
+			}
+			if (addr == sectorEnd)
 			{
-				ECanaRegs.CANMC.all = 2 | (0x100);
-				ECanaMboxes.MBOX2.MDH.all = 0xFFFF;
-				ECanaMboxes.MBOX2.MDL.all =  0xFFFC;
-				ECanaRegs.CANMC.all = 2;
-				ECanaRegs.CANTRS.all = 0x4;
-
-				while(ECanaRegs.CANTA.all != 0x4 ) {}  // Wait for all TAn bits to be set..
-				ECanaRegs.CANTA.all = 0x4;   // Clear all TAn
-				return 0x003d7800;
+				sectors &= ~bit;
+				*erased |= bit << 8;
 			}
-			BlockHeader.DestAddr++;
 		}
+		sectorEnd -= SECTOR_WORDS;
+	}
 
+	if (sectors == 0)
+	{
+		return 0;
+	}
+	return Flash_Erase(sectors, &FlashStatus);
+}
 
-		wordData = 0x0000;
-		byteData = 0x0000;
-
-		// Fetch the LSB
-		while(ECanaRegs.CANRMP.all == 0) { }
-		count ++;
-		if (count != ECanaMboxes.MBOX1.MDL.word.HI_WORD)
-		{
-			ECanaRegs.CANMC.all = 2 | (0x100);
-			ECanaMboxes.MBOX2.MDH.all = 0xFFFF;
-			ECanaMboxes.MBOX2.MDL.all = 0xFFFF;
-			ECanaRegs.CANMC.all = 2;
-			ECanaRegs.CANTRS.all = 0x4;
+//#################################################
+// Uint32 CAN_RxBench(Uint16 batches)
+//-----------------------------------------------
+// Loopback benchmark of the receive path up to the
+// stream state machine. In self-test mode MBOX3
+// sends on the data ID and the module receives its
+// own frames, without touching the bus. Each batch
+// fills canRing through the real CAN_RxIsr with
+// full frames in sequence, then takes them out
+// with the steps Bootload() runs for an in-order
+// frame: sequence check, ring advance and
+// unpacking, with each word stored as a RAM load
+// stores it. Flash programming, block headers and
+// window acks are not part of it, so this is the
+// most Bootload() can take with them free. Returns
+// the CPU cycles spent taking frames out, timed on
+// CPU timer 1, or 0xFFFFFFFF if a frame went
+// missing. The ISR is not counted, it runs as the
+// frames arrive at the bus rate.
+//-----------------------------------------------
 
-			while(ECanaRegs.CANTA.all != 0x4 ) {}  // Wait for all TAn bits to be set..
-			ECanaRegs.CANTA.all = 0x4;   // Clear all TAn
+#pragma CODE_SECTION(CAN_RxBench, ".LOADER")
+Uint32 CAN_RxBench(Uint16 batches)
+{
+	Uint32 cycles = 0;
+	Uint32 start;
+	Uint32 count = 0;
+	Uint16 words;
+	Uint16 rawWord;
+	Uint32 nextWords;
+	Uint16 wordData;
+	volatile Uint16 sink;	// Stands in for the RAM load area
+	Uint16 seq = 0;
+	Uint16 k;
+	volatile struct CAN_FRAME * frame;
 
-			return LOAD_ADDRESS_ON_FAIL;
+	EALLOW;
+	SysCtrlRegs.PCLKCR3.bit.CPUTIMER1ENCLK = 1;
+	CpuTimer1Regs.PRD.all = 0xFFFFFFFF;
+	CpuTimer1Regs.TPR.all = 0;
+	CpuTimer1Regs.TPRH.all = 0;
+	CpuTimer1Regs.TCR.all = 0x0020;		// Reload and run
+
+	// MBOX3 is still disabled, its ID and data may be written directly
+	ECanaMboxes.MBOX3.MSGID.all = ECanaMboxes.MBOX1.MSGID.all;
+	ECanaMboxes.MBOX3.MSGCTRL.all = 8;
+	ECanaMboxes.MBOX3.MDH.all = 0x3412AA55;
+	ECanaRegs.CANME.all = 0x000E;
+	ECanaRegs.CANMC.all = 0x0040;		// STM
+
+	while (batches--)
+	{
+		for (k = 1; k < CAN_RING_SIZE; k++)
+		{
+			// Change data request for MBOX3 around the write, as
+			// CAN_SendReply() does for MBOX2
+			ECanaRegs.CANMC.all = 0x0040 | 0x100 | 3;
+			ECanaMboxes.MBOX3.MDL.all = ((Uint32) ++seq << 16) | 0x7856;
+			ECanaRegs.CANMC.all = 0x0040;
+			ECanaRegs.CANTRS.all = 0x8;
+			while ((ECanaRegs.CANTA.all & 0x8) == 0) {}
+			ECanaRegs.CANTA.all = 0x8;
 		}
+		while (((canRingHead + 1) & (CAN_RING_SIZE - 1)) != canRingTail) {}
 
-		wordData =  (Uint16) ECanaMboxes.MBOX1.MDL.byte.BYTE2;	// LS byte
-		byteData =  (Uint16)ECanaMboxes.MBOX1.MDL.byte.BYTE3;	// MS byte
+		start = CpuTimer1Regs.TIM.all;
+		while (canRingHead != canRingTail)
+		{
+			frame = &canRing[canRingTail];
+			if ((Uint16) (frame->Mdl >> 16) != (Uint16) (count + 1))
+			{
+				break;
+			}
+			count++;
+			words = (frame->Dlc > 2) ? ((frame->Dlc - 2) >> 1) : 0;
+			rawWord = frame->Mdl;
+			nextWords = frame->Mdh;
+			canRingTail = (canRingTail + 1) & (CAN_RING_SIZE - 1);
 
-		// form the wordData from the MSB:LSB
-		wordData |= (byteData << 8);
+			for (k = 0; k < words; k++)
+			{
+				wordData = ((rawWord >> 8) & 0x00FF) | ((rawWord << 8) & 0xFF00);
+				rawWord = nextWords >> 16;
+				nextWords <<= 16;
+				sink = wordData;
+			}
+		}
+		cycles += start - CpuTimer1Regs.TIM.all;
+		if (canRingHead != canRingTail)
+		{
+			canRingTail = canRingHead;
+			cycles = 0xFFFFFFFF;
+			break;
+		}
+	}
 
-		BlockHeader.BlockSize = wordData;
+	ECanaRegs.CANMC.all = 2;
+	ECanaRegs.CANME.all = 0x0006;
+	CpuTimer1Regs.TCR.all = 0x0010;		// Stop
+	return cycles;
+}
 
+//#################################################
+// Uint16 CAN_RxHealth(Uint16 * lostSeen)
+//-----------------------------------------------
+// Receive health for a windowed host, sent in the
+// MDL high word of WINDOW and NACK replies. The
+// high byte holds the frames lost since the last
+// report, the low byte the larger of CANTEC and
+// CANREC. Both saturate at 255.
+//-----------------------------------------------
 
-		/* Clear all RMPn bits */
-		ECanaRegs.CANRMP.all = 0xFFFFFFFF;
+#pragma CODE_SECTION(CAN_RxHealth, ".LOADER")
+Uint16 CAN_RxHealth(Uint16 * lostSeen)
+{
+	Uint16 lost = canLost - *lostSeen;
+	Uint16 errors = ECanaRegs.CANREC.all & 0xFF;
 
+	*lostSeen += lost;
+	if ((ECanaRegs.CANTEC.all & 0xFF) > errors)
+	{
+		errors = ECanaRegs.CANTEC.all & 0xFF;
 	}
-
-	Uint16 * modeAddr = (Uint16 *) BOOT_MODE_ADDR;
-	for (i = 0; i < 4; i++)
+	if (lost > 0xFF)
 	{
-		*modeAddr++ = 0;
+		lost = 0xFF;
 	}
+	return (lost << 8) | errors;
+}
 
-	wordData = FLASH_SUCCESS;
-	Flash_Program(((Uint16 *) FLASH_STAT_ADDR), &wordData, 1, &FlashStatus);
-
-	ECanaRegs.CANMC.all = 2 | (0x100);
-	ECanaMboxes.MBOX2.MDH.all = 0x0000;
-	ECanaMboxes.MBOX2.MDL.all = 0x8000;
-	ECanaRegs.CANMC.all = 2;
-	ECanaRegs.CANTRS.all = 0x4;
-
-	while(ECanaRegs.CANTA.all != 0x4 ) {}  // Wait for all TAn bits to be set..
-	ECanaRegs.CANTA.all = 0x4;   // Clear all TAn
+//#################################################
+// interrupt void CAN_RxIsr(void)
+//-----------------------------------------------
+// eCAN-A mailbox 1 receive interrupt. Queues the
+// frame in canRing for Bootload(). When the ring
+// is full the frame is dropped, which shows up as
+// a sequence error, or a NACK for a windowed host.
+// Dropped frames, and frames the mailbox lost
+// (CANRML) before we got to it, count in canLost.
+//
+// Runs from the RAM copy of .LOADER, so it can
+// be taken while the flash API is programming.
+//-----------------------------------------------
 
-	EALLOW;
-	SysCtrlRegs.WDCR = 0x0028; // Enable watchdog module
-	SysCtrlRegs.WDKEY = 0x55;  // Clear the WD counter
-	SysCtrlRegs.WDKEY = 0xAA;
-	EDIS;
+#pragma CODE_SECTION(CAN_RxIsr, ".LOADER")
+interrupt void CAN_RxIsr(void)
+{
+	Uint16 next = (canRingHead + 1) & (CAN_RING_SIZE - 1);
 
-	return EntryAddr;
+	if (next != canRingTail)
+	{
+		canRing[canRingHead].Mdl = ECanaMboxes.MBOX1.MDL.all;
+		canRing[canRingHead].Mdh = ECanaMboxes.MBOX1.MDH.all;
+		canRing[canRingHead].Dlc = ECanaMboxes.MBOX1.MSGCTRL.bit.DLC;
+		canRingHead = next;
+	}
+	else
+	{
+		canLost++;
+	}
+	if (ECanaRegs.CANRML.all & 0x2)
+	{
+		canLost++;
+	}
+	ECanaRegs.CANRMP.all = 0x2;
+	PieCtrlRegs.PIEACK.all = PIEACK_GROUP9;
 }
 
 /*
@@ -698,6 +1499,95 @@ xx xx	-	Second word......
 xxx		- 	Last word of second section
 (more sections, if need be)
 00 00	- 	Section length of zero for next section indicates end of data.
+
+Each frame holds 2 bytes of sequence number, starting at 1, then one word LSB
+first (DLC 4). The sequence number is the low half of the frame's position in
+the stream and wraps after 65535. The loader counts positions in 32 bits and
+only ever looks for the next one, so a frame 65536 positions away can not be
+taken for it. Loaders with BOOT_MODE_MULTIWORD also take two or three words
+per frame (DLC 6 or 8).
+
+Version 4 loaders first send BOOT_STATUS_HELLO, laid out like a heartbeat,
+and wait HELLO_WAIT for an answer before erasing the slot. If the first frame
+is a WINDOW command with n > 0, sectors are erased when the first block
+reaching them arrives, while the host waits for acks, and sectors past the
+image are left alone. Otherwise the whole slot is erased as before.
+The hello goes out on MSGID BOOT_HELLO_ID (0x3) instead of 0x2, so hosts that
+take any frame on 0x2 for the heartbeat do not start streaming into a slot that
+is still being erased.
+
+Heartbeats carry the target slot in MDL and BOOT_CAPS in MDH. Loaders that
+send no BOOT_CAPS_MAGIC there only take the one word format and no commands.
+On success the reply MDH holds the CRC16 recorded in the application header,
+and the MDL high word the SECTORx mask of sectors that were found blank and
+not erased.
+Slot BOOT_SLOT_RAM asks for an image linked between RAM_LOAD_START and
+RAM_LOAD_END, and the success CRC covers that image in RAM. The load area is
+filled with 0xFFFF first, so gaps between blocks read as erased flash.
+
+Before the first word the host may send command frames, with sequence number 0:
+00 00 cc aa	-	Command cc, argument aa
+The loader answers every command on MSGID 0x2 with MDL = (cc << 16) | status,
+status being BOOT_STATUS_ACK or BOOT_STATUS_FAIL_COMMAND:
+01		-	PING, no argument
+03		-	SLOT_INFO, argument slot. MDH = (flash API sector mask << 24) | slot start.
+02		-	SET_PROFILE, argument BOOT_PROFILE_x. The ACK is sent in the old bit
+			timing, then a heartbeat in the new one. If no frame arrives within
+			PROFILE_REVERT_BEATS heartbeats the loader returns to the profile it
+			started in.
+04		-	WINDOW, argument n below CAN_RING_SIZE. The loader replies
+			BOOT_STATUS_WINDOW with MDH = frames programmed after every n frames,
+			so the host may keep up to the ring size in flight. Duplicate frames
+			are dropped and out of order ones held in the ring. A missing frame is
+			asked for with BOOT_STATUS_NACK, MDH = its position, once when
+			a later frame shows the gap and again on every stall heartbeat
+			period. 0 turns this off, any frame out of order then fails the load.
+05		-	KEEP, argument SECTORx mask. Version 5 loaders program these sectors
+			of the target slot without erasing them, for updates that only clear
+			bits of what the slot already holds. Only sectors not erased yet are
+			taken, so the host must have paced the stream with WINDOW, and never
+			the slot's first sector, which holds the header. Words that would
+			need a bit set fail the load with BOOT_STATUS_FAIL_PROGRAM.
+06		-	SLOT_CRC, argument slot. Version 6 loaders answer from the slot's
+			application header, MDH = (CRC16 << 16) | low half of its length, or
+			0xFFFFFFFF if the slot holds no complete image. Nothing is read but
+			the header, so hosts can check a cached record of the slot cheaply.
+07		-	READ, argument n, MDH = flash address. Version 7 loaders send the
+			4n words from there back on MSGID 0x2 as n frames of four words,
+			each MSB first, with nothing in between, then the ACK with MDH =
+			their CRC16. The range must lie in the slots, sectors H to C. A
+			host may have further READs in flight meanwhile, they wait in
+			the receive ring.
+08		-	SET_IDS, MDH = (data MSGID << 16) | reply MSGID, two different
+			standard IDs. Version 9 loaders acknowledge on the old IDs, then
+			take data frames on the first one and reply on the second until
+			the loader restarts. This lets a host bootload behind the control
+			traffic of a running vehicle bus instead of ahead of all of it.
+09		-	SELF_TEST, argument n. Version 10 loaders switch eCAN to self-test
+			mode and loop n batches of CAN_RING_SIZE - 1 eight byte frames
+			through CAN_RxIsr and the receive ring, then take them out with
+			Bootload()'s sequence check and unpacking, see CAN_RxBench().
+			Flash programming is not included. Nothing goes on the bus
+			meanwhile. The ACK has MDH = CPU cycles spent taking the frames
+			out, not counting CAN_RxIsr. The ring must be empty, and the
+			stream not started.
+0A		-	EXPECT_CRC, MDH = CRC16 of the image as the success reply would
+			report it. Version 11 loaders check the image against it once the
+			stream ends. On a mismatch they write no application header and
+			do not run a RAM image, reply BOOT_STATUS_FAIL_CRC with MDH = the
+			CRC of what they wrote, and start over.
+
+Once the stream has started, the load fails after STREAM_STALL_BEATS
+heartbeat periods without a usable frame.
+
+Loaders with BOOT_MODE_POSITION send full 32 bit positions in WINDOW and NACK
+replies. Older ones send the 16 bit sequence number there.
+
+Version 8 loaders report their receive health in the MDL high word of WINDOW
+and NACK replies: frames lost since the previous report, because the ring was
+full or mailbox 1 was overwritten (CANRML), in bits 15-8, and the larger of
+CANTEC and CANREC in bits 7-0. Both saturate at 255. Older loaders send 0
+there, so hosts can pace the stream from it without checking the version.
 */
 
 /*
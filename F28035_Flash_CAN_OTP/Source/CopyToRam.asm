@@ -0,0 +1,38 @@
+;;###########################################################################
+;;
+;; FILE:    CopyToRam.asm
+;;
+;; TITLE:   Block copy of OTP and flash resident sections to RAM.
+;;
+;; Functions:
+;;
+;;     void CopyToRam(Uint16 * ramAddr, Uint16 * otpAddr, Uint16 words)
+;;
+;; Notes:
+;;  PREAD under RPT reads one word per cycle plus the OTP wait states,
+;;  instead of the load/store/branch of a C loop for every word.
+;;###########################################################################
+
+    .def _CopyToRam
+
+    .sect ".OTP_INIT"
+
+;-----------------------------------------------
+; _CopyToRam
+;-----------------------------------------------
+; XAR4 = ramAddr (destination)
+; XAR5 = otpAddr (source, read through program space)
+; AL   = words
+;-----------------------------------------------
+
+_CopyToRam:
+    MOVL    XAR7,@XAR5
+    CMP     AL,#0
+    SB      copy_done,EQ
+    SUB     AL,#1
+    RPT     @AL
+ || PREAD   *XAR4++,*XAR7
+copy_done:
+    LRETR
+
+    .end
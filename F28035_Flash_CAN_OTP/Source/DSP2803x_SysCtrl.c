@@ -25,7 +25,6 @@
 //  TO RAM PRIOR TO CALLING InitSysCtrl(). THIS PREVENTS THE MCU FROM THROWING 
 //  AN EXCEPTION WHEN A CALL TO DELAY_US() IS MADE. 
 //
-//#pragma CODE_SECTION(InitFlash, "ramfuncs");
 
 //---------------------------------------------------------------------------
 // InitSysCtrl:
@@ -72,8 +71,22 @@ void InitSysCtrl(void)
 //                   CAUTION
 // This function MUST be executed out of RAM. Executing it
 // out of OTP/Flash will yield unpredictable results
+//
+// The wait states are derived from CPU_RATE and the flash/OTP access times
+// in the device data manual: ceil(access time / SYSCLKOUT period) - 1, and
+// at least 1 for random and OTP accesses. Values for the final CPU_RATE are
+// also safe while the device still runs from the slower reset clock.
+
+#define FLASH_PAGED_ACCESS	(40.0L)		// ns
+#define FLASH_RANDOM_ACCESS	(40.0L)		// ns
+#define OTP_ACCESS			(60.0L)		// ns
+
+#define WAITSTATES(t)		((Uint16) ((t) / CPU_RATE))
+#define FLASH_PAGEWAIT		(WAITSTATES(FLASH_PAGED_ACCESS))
+#define FLASH_RANDWAIT		(WAITSTATES(FLASH_RANDOM_ACCESS) ? WAITSTATES(FLASH_RANDOM_ACCESS) : 1)
+#define FLASH_OTPWAIT		(WAITSTATES(OTP_ACCESS) ? WAITSTATES(OTP_ACCESS) : 1)
 
-#pragma CODE_SECTION(InitFlash, ".OTP_INIT");
+#pragma CODE_SECTION(InitFlash, "ramfuncs");
 void InitFlash(void)
 {
    EALLOW;
@@ -81,13 +94,13 @@ void InitFlash(void)
    //of code executed from Flash.
 
    //Set the Random Waitstate for the Flash
-   FlashRegs.FBANKWAIT.bit.RANDWAIT = 2;
+   FlashRegs.FBANKWAIT.bit.RANDWAIT = FLASH_RANDWAIT;
 
    //Set the Paged Waitstate for the Flash
-   FlashRegs.FBANKWAIT.bit.PAGEWAIT = 2;
+   FlashRegs.FBANKWAIT.bit.PAGEWAIT = FLASH_PAGEWAIT;
 
    //Set the Waitstate for the OTP
-   FlashRegs.FOTPWAIT.bit.OTPWAIT = 3;
+   FlashRegs.FOTPWAIT.bit.OTPWAIT = FLASH_OTPWAIT;
 
    FlashRegs.FOPT.bit.ENPIPE = 1;
 
@@ -45,6 +45,9 @@ _InitBoot:
 
 __stack:    .usect ".stack",0
 
+; An application may branch here directly (see BootHandoff.h) with its
+; own stack still active, so always switch to the loader's stack.
+    MOV  SP,#__stack
 
 
 